@@ -0,0 +1,494 @@
+// Throughput benchmark for the host side: tree building, table generation, encoding and decoding.
+// Every data set is cut into blocks (like block_codec) and every operation runs over all blocks,
+// so ns/op is the time per block and MB/s is raw bytes per second.
+//
+// Results can be saved as CSV (-w) and compared against a saved run (-c), so a change can be
+// checked for regressions with two runs of the same binary.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "table_gen.h"
+#include "histogram.h"
+#include "software_model.h"
+#include "table_batch.h"
+#include "static_table.h"
+#include "block_codec.h"
+
+#define DEFAULT_LENGTH (1 << 20)
+#define REPETITIONS 5
+
+struct dataset_t {
+    std::string name;
+    std::vector<unsigned char> data;
+};
+
+struct result_t {
+    std::string dataset;
+    std::string op;
+    double ns_per_op;
+    double mb_per_s;
+};
+
+// xorshift64, so the synthetic data is the same on every run and every platform
+static uint64_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static dataset_t make_uniform(size_t length) {
+    dataset_t set = {"uniform", std::vector<unsigned char>(length)};
+    uint64_t state = 0x9e3779b97f4a7c15ull;
+    for (size_t i = 0; i < length; i++) set.data[i] = next_random(&state) >> 56;
+    return set;
+}
+
+// Long tail: symbol group k has probability 2^-(k+1). This one needs length limiting.
+static dataset_t make_geometric(size_t length) {
+    dataset_t set = {"geometric", std::vector<unsigned char>(length)};
+    uint64_t state = 0x2545f4914f6cdd1dull;
+    for (size_t i = 0; i < length; i++) {
+        uint64_t r = next_random(&state);
+        int group = std::min(__builtin_ctzll(r | (1ull << 31)), 31);
+        set.data[i] = group * 8 + (r >> 61);
+    }
+    return set;
+}
+
+// Zipf over all 256 symbols, a rough model of words and tokens
+static dataset_t make_zipf(size_t length) {
+    dataset_t set = {"zipf", std::vector<unsigned char>(length)};
+    double cumulative[256];
+    double sum = 0;
+    for (int s = 0; s < 256; s++) cumulative[s] = sum += 1.0 / (s + 1);
+    uint64_t state = 0xd1b54a32d192ed03ull;
+    for (size_t i = 0; i < length; i++) {
+        double r = (next_random(&state) >> 11) * (sum / 9007199254740992.0);
+        set.data[i] = std::upper_bound(cumulative, cumulative + 255, r) - cumulative;
+    }
+    return set;
+}
+
+// 16 symbols, all 4 bits: the shortest trees and a single table
+static dataset_t make_sparse(size_t length) {
+    dataset_t set = {"sparse", std::vector<unsigned char>(length)};
+    uint64_t state = 0x8cb92ba72f3d8dd7ull;
+    for (size_t i = 0; i < length; i++) set.data[i] = 'a' + (next_random(&state) >> 60);
+    return set;
+}
+
+// One symbol almost everywhere: 1-bit codes, one hop per symbol
+static dataset_t make_skewed(size_t length) {
+    dataset_t set = {"skewed", std::vector<unsigned char>(length)};
+    uint64_t state = 0x94d049bb133111ebull;
+    for (size_t i = 0; i < length; i++) {
+        uint64_t r = next_random(&state);
+        set.data[i] = (r & 0xff) < 243 ? 0 : r >> 56;
+    }
+    return set;
+}
+
+// A file, repeated up to length if tile is set, otherwise as a whole
+static bool load_file(const char* filename, size_t length, bool tile, dataset_t* set) {
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    std::vector<unsigned char> content;
+    unsigned char buffer[1 << 16];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) content.insert(content.end(), buffer, buffer + n);
+    fclose(file);
+    if (content.empty()) return false;
+    const char* slash = strrchr(filename, '/');
+    set->name = slash ? slash + 1 : filename;
+    if (!tile) {
+        set->data.swap(content);
+        return true;
+    }
+    set->data.resize(length);
+    for (size_t i = 0; i < length; i += content.size())
+        memcpy(&set->data[i], content.data(), std::min(content.size(), length - i));
+    return true;
+}
+
+// Everything the operations need, prepared once per data set
+struct prepared_t {
+    size_t block_size;
+    size_t n_blocks;
+    std::vector<unsigned> freq; // 256 per block
+    std::vector<huffman_code_t> codes; // 256 per block
+    std::vector<unsigned char> images; // TABLE_IMAGE_SIZE per block
+    std::vector<fast_decode_table_t> fast; // One per block
+    std::vector<unsigned char> payload; // block_size + 8 per block
+    std::vector<size_t> payload_length;
+    std::vector<unsigned char> interleaved; // interleaved_capacity() per block
+    std::vector<size_t> interleaved_length;
+    std::vector<unsigned char> static_payload; // static_capacity() per block, coded with static_text_table
+    std::vector<size_t> static_length;
+};
+
+static size_t interleaved_capacity(const prepared_t* p) {
+    return p->block_size + INTERLEAVED_JUMP_TABLE_SIZE + 8;
+}
+
+static size_t static_capacity(const prepared_t* p) {
+    return p->block_size * STATIC_CODE_MAX_LENGTH / 8 + 8;
+}
+
+static size_t block_length(const dataset_t* set, const prepared_t* p, size_t block) {
+    return std::min(p->block_size, set->data.size() - block * p->block_size);
+}
+
+static void prepare(const dataset_t* set, size_t block_size, prepared_t* p) {
+    p->block_size = block_size;
+    p->n_blocks = (set->data.size() + block_size - 1) / block_size;
+    p->freq.resize(p->n_blocks * 256);
+    p->codes.resize(p->n_blocks * 256);
+    p->images.resize(p->n_blocks * TABLE_IMAGE_SIZE);
+    p->fast.resize(p->n_blocks);
+    p->payload.resize(p->n_blocks * (block_size + 8));
+    p->payload_length.resize(p->n_blocks);
+    p->interleaved.resize(p->n_blocks * interleaved_capacity(p));
+    p->interleaved_length.resize(p->n_blocks);
+    p->static_payload.resize(p->n_blocks * static_capacity(p));
+    p->static_length.resize(p->n_blocks);
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        const unsigned char* data = &set->data[b * block_size];
+        size_t length = block_length(set, p, b);
+        count_frequency(data, length, &p->freq[b * 256]);
+        huffman_arena_t arena;
+        huffman_t* root = build_limited_huffman_tree(&p->freq[b * 256], 256, HUFFMAN_MAX_CODE_LENGTH,
+            HUFFMAN_MAX_TABLES, &arena);
+        generate_code_table(root, &p->codes[b * 256]);
+        generate_fast_decode_table(&p->codes[b * 256], &p->fast[b]);
+        generate_table_image(root, &p->images[b * TABLE_IMAGE_SIZE]);
+        p->payload_length[b] = encode_huffman(&p->codes[b * 256], data, length,
+            &p->payload[b * (block_size + 8)], block_size + 8);
+        p->interleaved_length[b] = encode_huffman_interleaved(&p->codes[b * 256], data, length,
+            &p->interleaved[b * interleaved_capacity(p)], interleaved_capacity(p));
+        p->static_length[b] = encode_static<static_text_table>(data, length, &p->static_payload[b * static_capacity(p)],
+            static_capacity(p));
+    }
+}
+
+// The operations. Each one runs over every block and returns something derived from the
+// result, so the compiler can't drop the work.
+static size_t run_tree(const dataset_t*, const prepared_t* p, unsigned char*) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        huffman_arena_t arena;
+        sum += build_huffman_tree(&p->freq[b * 256], 256, &arena)->height;
+    }
+    return sum;
+}
+
+static size_t run_table(const dataset_t*, const prepared_t* p, unsigned char*) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        table_root_t table;
+        sum += generate_table(&table, &p->freq[b * 256], 256);
+        free_table(&table);
+    }
+    return sum;
+}
+
+// All the blocks as one batch: one allocation instead of five per block
+static size_t run_table_batch(const dataset_t*, const prepared_t* p, unsigned char*) {
+    table_batch_t batch;
+    batch.generate(p->freq.data(), p->n_blocks);
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) sum += batch.n_table(b);
+    return sum;
+}
+
+static size_t run_encode(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++)
+        sum += encode_huffman(&p->codes[b * 256], &set->data[b * p->block_size], block_length(set, p, b),
+            scratch, p->block_size + 8);
+    return sum;
+}
+
+// The hardware's encoding loop: one table walk per symbol over the same image as decode
+static size_t run_encode_tables(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        table_root_t table;
+        map_table_image(&table, &p->images[b * TABLE_IMAGE_SIZE]);
+        sum += encode_huffman_tables(&table, &set->data[b * p->block_size], block_length(set, p, b), scratch,
+            p->block_size + 8);
+    }
+    return sum;
+}
+
+static size_t run_decode(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        table_root_t table;
+        map_table_image(&table, &p->images[b * TABLE_IMAGE_SIZE]);
+        sum += decode_huffman(&table, &p->payload[b * (p->block_size + 8)], p->payload_length[b], scratch,
+            block_length(set, p, b));
+    }
+    return sum;
+}
+
+static size_t run_decode_fast(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        table_root_t table;
+        map_table_image(&table, &p->images[b * TABLE_IMAGE_SIZE]);
+        sum += decode_huffman_fast(&table, &p->fast[b], &p->payload[b * (p->block_size + 8)], p->payload_length[b],
+            scratch, block_length(set, p, b));
+    }
+    return sum;
+}
+
+static size_t run_encode_interleaved(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++)
+        sum += encode_huffman_interleaved(&p->codes[b * 256], &set->data[b * p->block_size], block_length(set, p, b),
+            scratch, interleaved_capacity(p));
+    return sum;
+}
+
+static size_t run_decode_interleaved(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        table_root_t table;
+        map_table_image(&table, &p->images[b * TABLE_IMAGE_SIZE]);
+        sum += decode_huffman_interleaved(&table, &p->fast[b], &p->interleaved[b * interleaved_capacity(p)],
+            p->interleaved_length[b], scratch, block_length(set, p, b));
+    }
+    return sum;
+}
+
+// The static text model: no tables to build, and the lookups are compiled in
+static size_t run_encode_static(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++)
+        sum += encode_static<static_text_table>(&set->data[b * p->block_size], block_length(set, p, b), scratch,
+            static_capacity(p));
+    return sum;
+}
+
+static size_t run_decode_static(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    size_t sum = 0;
+    for (size_t b = 0; b < p->n_blocks; b++)
+        sum += decode_static<static_text_table>(&p->static_payload[b * static_capacity(p)], p->static_length[b],
+            scratch, block_length(set, p, b));
+    return sum;
+}
+
+typedef size_t (*operation_t)(const dataset_t*, const prepared_t*, unsigned char*);
+
+// Repeat op until it has run for min_seconds, REPETITIONS times, and keep the median
+static double time_operation(operation_t op, const dataset_t* set, const prepared_t* p, unsigned char* scratch,
+    double min_seconds, size_t* sink) {
+    typedef std::chrono::steady_clock clock;
+    double samples[REPETITIONS];
+    for (int r = 0; r < REPETITIONS; r++) {
+        size_t n_runs = 0;
+        double elapsed = 0;
+        clock::time_point start = clock::now();
+        do {
+            *sink += op(set, p, scratch);
+            n_runs++;
+            elapsed = std::chrono::duration<double>(clock::now() - start).count();
+        } while (elapsed < min_seconds);
+        samples[r] = elapsed / n_runs;
+    }
+    std::sort(samples, samples + REPETITIONS);
+    return samples[REPETITIONS / 2];
+}
+
+static bool check_roundtrip(const dataset_t* set, const prepared_t* p, unsigned char* scratch) {
+    for (size_t b = 0; b < p->n_blocks; b++) {
+        size_t length = block_length(set, p, b);
+        table_root_t table;
+        map_table_image(&table, &p->images[b * TABLE_IMAGE_SIZE]);
+        decode_huffman(&table, &p->payload[b * (p->block_size + 8)], p->payload_length[b], scratch, length);
+        if (memcmp(scratch, &set->data[b * p->block_size], length)) return false;
+        memset(scratch, 0, length);
+        decode_huffman_fast(&table, &p->fast[b], &p->payload[b * (p->block_size + 8)], p->payload_length[b], scratch,
+            length);
+        if (memcmp(scratch, &set->data[b * p->block_size], length)) return false;
+        memset(scratch, 0, length);
+        decode_huffman_interleaved(&table, &p->fast[b], &p->interleaved[b * interleaved_capacity(p)],
+            p->interleaved_length[b], scratch, length);
+        if (memcmp(scratch, &set->data[b * p->block_size], length)) return false;
+    }
+    return true;
+}
+
+static bool write_results(const char* filename, const std::vector<result_t>& results) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+    fprintf(file, "dataset,op,ns_per_op,mb_per_s\n");
+    for (const result_t& r : results)
+        fprintf(file, "%s,%s,%.1f,%.2f\n", r.dataset.c_str(), r.op.c_str(), r.ns_per_op, r.mb_per_s);
+    return fclose(file) == 0;
+}
+
+static bool read_results(const char* filename, std::vector<result_t>* results) {
+    FILE* file = fopen(filename, "r");
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+    char line[512];
+    if (!fgets(line, sizeof(line), file)) {
+        fclose(file);
+        return false;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        char dataset[256], op[64];
+        result_t r;
+        if (sscanf(line, "%255[^,],%63[^,],%lf,%lf", dataset, op, &r.ns_per_op, &r.mb_per_s) != 4) continue;
+        r.dataset = dataset;
+        r.op = op;
+        results->push_back(r);
+    }
+    fclose(file);
+    return true;
+}
+
+// Print the change against the baseline. Return the number of results slower by more than threshold percent.
+static int compare_results(const std::vector<result_t>& baseline, const std::vector<result_t>& results,
+    double threshold) {
+    int n_regressed = 0;
+    printf("\n%-16s %-8s %12s %12s %8s\n", "dataset", "op", "base MB/s", "MB/s", "change");
+    for (const result_t& r : results) {
+        auto base = std::find_if(baseline.begin(), baseline.end(), [&](const result_t& b) {
+            return b.dataset == r.dataset && b.op == r.op;
+        });
+        if (base == baseline.end()) {
+            printf("%-16s %-8s %12s %12.2f %8s\n", r.dataset.c_str(), r.op.c_str(), "-", r.mb_per_s, "new");
+            continue;
+        }
+        double change = (r.mb_per_s / base->mb_per_s - 1) * 100;
+        bool regressed = change < -threshold;
+        n_regressed += regressed;
+        printf("%-16s %-8s %12.2f %12.2f %+7.1f%%%s\n", r.dataset.c_str(), r.op.c_str(), base->mb_per_s, r.mb_per_s,
+            change, regressed ? "  REGRESSION" : "");
+    }
+    return n_regressed;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [options] [file...]\n"
+        "  -s SIZE   size of each synthetic data set in bytes (default %d)\n"
+        "  -b SIZE   block size in bytes, at most %d (default)\n"
+        "  -m MS     minimum time per measurement in milliseconds (default 100)\n"
+        "  -w FILE   save the results as CSV\n"
+        "  -c FILE   compare against results saved with -w\n"
+        "  -x PCT    with -c, slowdown that counts as a regression (default 5)\n"
+        "Files are benchmarked as a whole. Without files, data/sample_data.txt is tiled to SIZE if it exists.\n"
+        "With -c, the exit status is 2 if anything regressed.\n",
+        name, DEFAULT_LENGTH, BLOCK_SIZE_MAX);
+}
+
+int main(int argc, char** argv) {
+    size_t length = DEFAULT_LENGTH;
+    size_t block_size = BLOCK_SIZE_MAX;
+    double min_seconds = 0.1;
+    const char* save_name = NULL;
+    const char* baseline_name = NULL;
+    double threshold = 5;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:b:m:w:c:x:h")) != -1) {
+        switch (opt) {
+            case 's': length = strtoul(optarg, NULL, 0); break;
+            case 'b': block_size = strtoul(optarg, NULL, 0); break;
+            case 'm': min_seconds = atof(optarg) / 1000; break;
+            case 'w': save_name = optarg; break;
+            case 'c': baseline_name = optarg; break;
+            case 'x': threshold = atof(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (length == 0 || block_size == 0 || block_size > BLOCK_SIZE_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<result_t> baseline;
+    if (baseline_name && !read_results(baseline_name, &baseline)) return 1;
+
+    std::vector<dataset_t> sets;
+    sets.push_back(make_uniform(length));
+    sets.push_back(make_geometric(length));
+    sets.push_back(make_zipf(length));
+    sets.push_back(make_sparse(length));
+    sets.push_back(make_skewed(length));
+    if (optind == argc) {
+        dataset_t set;
+        if (load_file("data/sample_data.txt", length, true, &set)) sets.push_back(set);
+    }
+    for (int i = optind; i < argc; i++) {
+        dataset_t set;
+        if (!load_file(argv[i], 0, false, &set)) {
+            fprintf(stderr, "can't read %s\n", argv[i]);
+            return 1;
+        }
+        sets.push_back(set);
+    }
+
+    static const struct {
+        const char* name;
+        operation_t op;
+    } operations[] = {
+        {"tree", run_tree},
+        {"table", run_table},
+        {"batch", run_table_batch},
+        {"encode", run_encode},
+        {"tblenc", run_encode_tables},
+        {"decode", run_decode},
+        {"fastdec", run_decode_fast},
+        {"enc4", run_encode_interleaved},
+        {"dec4", run_decode_interleaved},
+        {"stenc", run_encode_static},
+        {"stdec", run_decode_static},
+    };
+
+    std::vector<result_t> results;
+    // Room for the static text model's worst case, which is bigger than all the others
+    std::vector<unsigned char> scratch(block_size * STATIC_CODE_MAX_LENGTH / 8 + 8);
+    size_t sink = 0;
+    printf("%-16s %-8s %12s %12s\n", "dataset", "op", "ns/op", "MB/s");
+    for (const dataset_t& set : sets) {
+        prepared_t p;
+        prepare(&set, block_size, &p);
+        if (!check_roundtrip(&set, &p, scratch.data())) {
+            fprintf(stderr, "%s: decoded data doesn't match\n", set.name.c_str());
+            return 1;
+        }
+        for (const auto& operation : operations) {
+            double seconds = time_operation(operation.op, &set, &p, scratch.data(), min_seconds, &sink);
+            result_t r;
+            r.dataset = set.name;
+            r.op = operation.name;
+            r.ns_per_op = seconds * 1e9 / p.n_blocks;
+            r.mb_per_s = set.data.size() / seconds / 1e6;
+            printf("%-16s %-8s %12.1f %12.2f\n", r.dataset.c_str(), r.op.c_str(), r.ns_per_op, r.mb_per_s);
+            fflush(stdout);
+            results.push_back(r);
+        }
+    }
+    // Keep the results of the operations alive
+    if (sink == 1) printf("\n");
+
+    if (save_name && !write_results(save_name, results)) return 1;
+    if (baseline_name && compare_results(baseline, results, threshold)) return 2;
+    return 0;
+}
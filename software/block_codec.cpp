@@ -0,0 +1,293 @@
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+#include "table_gen.h"
+#include "histogram.h"
+#include "software_model.h"
+#include "block_codec.h"
+#include "thread_pool.h"
+#include "block_stats.h"
+
+// Below this many symbols the table walk is faster than building the single-lookup table
+#define FAST_DECODE_MIN_BLOCK 4096
+
+static void write_u32(unsigned char* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++) dst[i] = value >> (8 * i);
+}
+
+static uint32_t read_u32(const unsigned char* src) {
+    return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+// Largest frame a block of this size can produce. A Huffman code is never worse than
+// the plain 8-bit code, so the payload is at most the raw size (plus the partial word,
+// and the jump table if it's interleaved).
+size_t max_block_frame_size(size_t length) {
+    return BLOCK_HEADER_SIZE + PACKED_TABLE_MAX_SIZE + INTERLEAVED_JUMP_TABLE_SIZE + length + 8;
+}
+
+// Estimate from the histogram alone whether coding the block is worth it: the entropy is
+// what the payload will come close to, plus the smallest table image. Random-looking data
+// comes out at (or a bit over) its raw size, and we'd spend the tree, the tables and the
+// accelerator time for nothing.
+static bool worth_coding(const unsigned* freq, size_t length, unsigned flags, double min_gain) {
+    size_t table_size = flags & STREAM_FLAG_PACKED_TABLES ? PACKED_TABLE_HEADER_SIZE + packed_table_body_size(1)
+        : TABLE_IMAGE_SIZE;
+    return entropy_bits(freq) / 8 + table_size <= (1 - min_gain) * length;
+}
+
+static size_t store_block(const unsigned char* data, size_t length, unsigned char* frame) {
+    write_u32(frame, length | BLOCK_STORED);
+    write_u32(frame + 4, length);
+    memcpy(frame + BLOCK_HEADER_SIZE, data, length);
+    return BLOCK_HEADER_SIZE + length;
+}
+
+// Encode one block: histogram, tree, tables and payload, in the format given by the
+// STREAM_FLAG_* flags. frame must hold max_block_frame_size(length) bytes.
+// With STREAM_FLAG_STORED_BLOCKS, the block is stored instead if the histogram says coding
+// won't save min_gain of it, or if the coded frame turns out bigger than the stored one.
+// If stats is given, it's filled in for the block.
+// Return the frame size.
+size_t encode_block(const unsigned char* data, size_t length, unsigned char* frame, unsigned flags,
+    block_stats_t* stats, double min_gain) {
+    uint64_t start = stats ? stats_clock_ns() : 0;
+    unsigned freq[256];
+    count_frequency(data, length, freq);
+    end_stage(stats, STAGE_HISTOGRAM, &start);
+    bool stored_blocks = flags & STREAM_FLAG_STORED_BLOCKS;
+    if (stored_blocks && !worth_coding(freq, length, flags, min_gain)) {
+        if (stats) {
+            stats->stage_ns[STAGE_TREE] = stats->stage_ns[STAGE_TABLE] = stats->stage_ns[STAGE_ENCODE] = 0;
+            fill_stored_block_stats(stats, freq, length);
+        }
+        return store_block(data, length, frame);
+    }
+
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+    end_stage(stats, STAGE_TREE, &start);
+    size_t table_size = TABLE_IMAGE_SIZE;
+    size_t n_table;
+    if (flags & STREAM_FLAG_PACKED_TABLES) {
+        unsigned char image[TABLE_IMAGE_SIZE];
+        n_table = generate_table_image(root, image);
+        struct table_root_t table;
+        map_table_image(&table, image);
+        table_size = write_packed_table_image(&table, n_table, frame + BLOCK_HEADER_SIZE);
+    } else {
+        n_table = generate_table_image(root, frame + BLOCK_HEADER_SIZE);
+    }
+    end_stage(stats, STAGE_TABLE, &start);
+
+    unsigned char* payload = frame + BLOCK_HEADER_SIZE + table_size;
+    size_t limit = max_block_frame_size(length) - BLOCK_HEADER_SIZE - table_size;
+    size_t payload_length = flags & STREAM_FLAG_INTERLEAVED ? encode_huffman_interleaved(codes, data, length, payload, limit)
+        : encode_huffman(codes, data, length, payload, limit);
+    end_stage(stats, STAGE_ENCODE, &start);
+    if (stored_blocks && table_size + payload_length >= length) {
+        if (stats) fill_stored_block_stats(stats, freq, length);
+        return store_block(data, length, frame);
+    }
+    if (stats) fill_block_stats(stats, freq, codes, n_table, length, payload_length);
+    write_u32(frame, length);
+    write_u32(frame + 4, payload_length);
+    return BLOCK_HEADER_SIZE + table_size + payload_length;
+}
+
+// Raw size of the frame at the start of frame, which holds at least BLOCK_HEADER_SIZE bytes
+size_t block_raw_length(const unsigned char* frame) {
+    return read_u32(frame) & ~BLOCK_STORED;
+}
+
+// Size of the table image at the start of image, or 0 if it doesn't fit in length
+static size_t table_image_size(const unsigned char* image, size_t length, unsigned flags) {
+    size_t size = TABLE_IMAGE_SIZE;
+    if (flags & STREAM_FLAG_PACKED_TABLES) {
+        if (length < PACKED_TABLE_HEADER_SIZE) return 0;
+        size = PACKED_TABLE_HEADER_SIZE + (image[6] | image[7] << 8) * 8;
+    }
+    return size <= length ? size : 0;
+}
+
+// Size of the frame at the start of input, or 0 if it's truncated
+size_t block_frame_size(const unsigned char* input, size_t length, unsigned flags) {
+    if (length < BLOCK_HEADER_SIZE) return 0;
+    size_t table_size = 0;
+    if (!(flags & STREAM_FLAG_STORED_BLOCKS) || !(read_u32(input) & BLOCK_STORED)) {
+        table_size = table_image_size(input + BLOCK_HEADER_SIZE, length - BLOCK_HEADER_SIZE, flags);
+        if (!table_size) return 0;
+    }
+    size_t frame_length = BLOCK_HEADER_SIZE + table_size + read_u32(input + 4);
+    return frame_length <= length ? frame_length : 0;
+}
+
+// Decode one frame of a stream with the given flags. The tables are used in place,
+// straight from the frame.
+// Return the raw size, or 0 if the frame is broken or the output doesn't fit.
+size_t decode_block(const unsigned char* frame, size_t frame_length, unsigned char* output, size_t limit,
+    unsigned flags) {
+    if (frame_length < BLOCK_HEADER_SIZE) return 0;
+    size_t raw_length = read_u32(frame);
+    size_t payload_length = read_u32(frame + 4);
+    if ((flags & STREAM_FLAG_STORED_BLOCKS) && (raw_length & BLOCK_STORED)) {
+        raw_length &= ~BLOCK_STORED;
+        if (payload_length != raw_length || payload_length > frame_length - BLOCK_HEADER_SIZE || raw_length > limit)
+            return 0;
+        memcpy(output, frame + BLOCK_HEADER_SIZE, raw_length);
+        return raw_length;
+    }
+    struct table_root_t table;
+    size_t table_size;
+    if (flags & STREAM_FLAG_PACKED_TABLES) {
+        table_size = map_packed_table_image(&table, frame + BLOCK_HEADER_SIZE, frame_length - BLOCK_HEADER_SIZE);
+    } else {
+        table_size = table_image_size(frame + BLOCK_HEADER_SIZE, frame_length - BLOCK_HEADER_SIZE, flags);
+        if (table_size) {
+            map_table_image(&table, frame + BLOCK_HEADER_SIZE);
+            // Nothing else checks a full image, and the decoder follows its links blindly
+            if (!check_next_table(table.next_table, HUFFMAN_MAX_TABLES)) table_size = 0;
+        }
+    }
+    if (!table_size || payload_length > frame_length - BLOCK_HEADER_SIZE - table_size || raw_length > limit) return 0;
+    const unsigned char* payload = frame + BLOCK_HEADER_SIZE + table_size;
+    fast_decode_table_t fast;
+    bool use_fast = raw_length >= FAST_DECODE_MIN_BLOCK;
+    if (use_fast) {
+        huffman_code_t codes[256];
+        generate_code_table_from_tables(&table, codes);
+        generate_fast_decode_table(codes, &fast);
+    }
+    if (flags & STREAM_FLAG_INTERLEAVED) {
+        if (!decode_huffman_interleaved(&table, use_fast ? &fast : NULL, payload, payload_length, output, raw_length))
+            return 0;
+    } else if (use_fast) {
+        decode_huffman_fast(&table, &fast, payload, payload_length, output, raw_length);
+    } else {
+        decode_huffman(&table, payload, payload_length, output, raw_length);
+    }
+    return raw_length;
+}
+
+// Split data into blocks and encode them on a thread pool. A window of a few blocks per
+// thread is encoded while the previous window is written out, so the workers stay busy
+// and the memory use doesn't grow with the input.
+// Return the number of bytes written.
+size_t encode_blocks(const unsigned char* data, size_t length, FILE* output, const block_options_t* options) {
+    size_t block_size = options->block_size;
+    if (block_size == 0 || block_size > BLOCK_SIZE_MAX) {
+        fprintf(stderr, "encode_blocks doesn't support block size %zu\n", block_size);
+        return 0;
+    }
+    unsigned char header[STREAM_HEADER_SIZE] = {0};
+    memcpy(header, STREAM_MAGIC, 4);
+    header[4] = STREAM_VERSION;
+    unsigned flags = STREAM_FLAG_PACKED_TABLES | (options->interleaved ? STREAM_FLAG_INTERLEAVED : 0)
+        | (options->min_gain >= 0 ? STREAM_FLAG_STORED_BLOCKS : 0);
+    header[5] = flags;
+    write_u32(header + 8, block_size);
+    size_t n_written = fwrite(header, 1, STREAM_HEADER_SIZE, output);
+
+    thread_pool_t pool(options->n_threads);
+    size_t n_blocks = (length + block_size - 1) / block_size;
+    if (options->stats) options->stats->resize(n_blocks);
+    size_t window = 4 * pool.size();
+    size_t frame_capacity = max_block_frame_size(block_size);
+    std::vector<unsigned char> frames[2];
+    std::vector<size_t> frame_sizes[2];
+    for (int i = 0; i < 2; i++) {
+        frames[i].resize(window * frame_capacity);
+        frame_sizes[i].resize(window);
+    }
+
+    auto submit_window = [&](size_t first_block) {
+        size_t n = n_blocks - first_block < window ? n_blocks - first_block : window;
+        int buffer = (first_block / window) & 1;
+        for (size_t i = 0; i < n; i++) {
+            pool.submit([&, first_block, buffer, i] {
+                size_t offset = (first_block + i) * block_size;
+                size_t block_length = length - offset < block_size ? length - offset : block_size;
+                frame_sizes[buffer][i] = encode_block(data + offset, block_length, &frames[buffer][i * frame_capacity],
+                    flags, options->stats ? &(*options->stats)[first_block + i] : NULL, options->min_gain);
+            });
+        }
+    };
+
+    if (n_blocks) submit_window(0);
+    pool.wait();
+    for (size_t first_block = 0; first_block < n_blocks; first_block += window) {
+        if (first_block + window < n_blocks) submit_window(first_block + window);
+        size_t n = n_blocks - first_block < window ? n_blocks - first_block : window;
+        int buffer = (first_block / window) & 1;
+        for (size_t i = 0; i < n; i++)
+            n_written += fwrite(&frames[buffer][i * frame_capacity], 1, frame_sizes[buffer][i], output);
+        pool.wait();
+    }
+    return n_written;
+}
+
+// Check the stream header at the start of input and return its flags.
+// Return false if it's not a block stream we can read.
+bool read_stream_header(const unsigned char* input, size_t length, unsigned* flags) {
+    if (length < STREAM_HEADER_SIZE || memcmp(input, STREAM_MAGIC, 4)) return false;
+    if (input[4] == 1) *flags = 0;
+    else if (input[4] == STREAM_VERSION) *flags = input[5];
+    else return false;
+    return !(*flags & ~(STREAM_FLAG_INTERLEAVED | STREAM_FLAG_PACKED_TABLES | STREAM_FLAG_STORED_BLOCKS));
+}
+
+// Decode a whole stream. The frames are indexed first, then decoded in parallel, each
+// straight into its place in the output.
+// Return the decoded size, or 0 if any frame is broken or the output doesn't fit.
+size_t decode_blocks(const unsigned char* input, size_t length, unsigned char* output, size_t limit, int n_threads) {
+    unsigned flags;
+    if (!read_stream_header(input, length, &flags)) {
+        fprintf(stderr, "decode_blocks: not a block stream\n");
+        return 0;
+    }
+    // Index the frames
+    std::vector<size_t> frame_offsets;
+    std::vector<size_t> output_offsets;
+    size_t pos = STREAM_HEADER_SIZE;
+    size_t output_length = 0;
+    while (pos < length) {
+        size_t frame_length = block_frame_size(input + pos, length - pos, flags);
+        if (!frame_length) {
+            fprintf(stderr, "decode_blocks: truncated frame at %zu\n", pos);
+            return 0;
+        }
+        size_t raw_length = block_raw_length(input + pos);
+        frame_offsets.push_back(pos);
+        output_offsets.push_back(output_length);
+        pos += frame_length;
+        output_length += raw_length;
+    }
+    if (output_length > limit) {
+        fprintf(stderr, "decode_blocks: output limit hit\n");
+        return 0;
+    }
+    frame_offsets.push_back(length);
+
+    // A frame can look fine from its header and still fail to decode (bad tables or jump
+    // table), so every block records whether it got its raw size out
+    std::vector<char> failed(output_offsets.size());
+    thread_pool_t pool(n_threads);
+    for (size_t i = 0; i < output_offsets.size(); i++) {
+        pool.submit([&, i] {
+            const unsigned char* frame = input + frame_offsets[i];
+            failed[i] = decode_block(frame, frame_offsets[i + 1] - frame_offsets[i], output + output_offsets[i],
+                limit - output_offsets[i], flags) != block_raw_length(frame);
+        });
+    }
+    pool.wait();
+    for (size_t i = 0; i < failed.size(); i++) {
+        if (failed[i]) {
+            fprintf(stderr, "decode_blocks: broken frame at %zu\n", frame_offsets[i]);
+            return 0;
+        }
+    }
+    return output_length;
+}
@@ -0,0 +1,58 @@
+#ifndef BLOCK_CODEC_H_
+#define BLOCK_CODEC_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+struct block_stats_t;
+
+// Framed stream of independently coded blocks. Every block carries its own table image,
+// so the blocks can be encoded, decoded, or sent to the accelerator in any order.
+//
+// Stream header: "HUFB", u8 version, u8 flags, 2 reserved bytes, u32 block size
+// Block frame: u32 raw length, u32 payload length, table image, payload
+// The table image is a packed one (write_packed_table_image()) if STREAM_FLAG_PACKED_TABLES
+// is set, and a full TABLE_IMAGE_SIZE one otherwise.
+// If STREAM_FLAG_STORED_BLOCKS is set, a frame with BLOCK_STORED in its raw length is a
+// stored one: no table image, and the payload is the raw data.
+// All integers are little endian. The stream ends at the end of the last frame.
+// Version 1 is the same without the flags.
+
+#define STREAM_MAGIC "HUFB"
+#define STREAM_VERSION 2
+// The payloads are in the interleaved format, see encode_huffman_interleaved()
+#define STREAM_FLAG_INTERLEAVED 1
+#define STREAM_FLAG_PACKED_TABLES 2
+#define STREAM_FLAG_STORED_BLOCKS 4
+#define BLOCK_STORED 0x80000000u
+#define STREAM_HEADER_SIZE 12
+#define BLOCK_HEADER_SIZE 8
+// The frequency sent to the hardware is 15 bits wide, and a block of one repeated byte
+// has that byte's frequency equal to its size, so blocks are at most 2^15 - 1 bytes
+#define BLOCK_SIZE_MAX ((1 << 15) - 1)
+// Default for block_options_t::min_gain
+#define STORED_BLOCK_MIN_GAIN 0.01
+
+struct block_options_t {
+    size_t block_size; // Raw bytes per block, at most BLOCK_SIZE_MAX
+    int n_threads; // 0 = one per hardware thread
+    bool interleaved; // Split every payload into INTERLEAVED_STREAMS bitstreams
+    std::vector<block_stats_t>* stats; // If not NULL, gets the statistics of every block
+    // A block is stored unless coding it saves at least this fraction of its size.
+    // Below 0 every block is coded (and the stream can't have stored blocks).
+    double min_gain;
+};
+
+size_t max_block_frame_size(size_t length);
+size_t encode_block(const unsigned char* data, size_t length, unsigned char* frame, unsigned flags = 0,
+    block_stats_t* stats = NULL, double min_gain = STORED_BLOCK_MIN_GAIN);
+size_t block_raw_length(const unsigned char* frame);
+size_t block_frame_size(const unsigned char* input, size_t length, unsigned flags = 0);
+size_t decode_block(const unsigned char* frame, size_t frame_length, unsigned char* output, size_t limit,
+    unsigned flags = 0);
+bool read_stream_header(const unsigned char* input, size_t length, unsigned* flags);
+size_t encode_blocks(const unsigned char* data, size_t length, FILE* output, const block_options_t* options);
+size_t decode_blocks(const unsigned char* input, size_t length, unsigned char* output, size_t limit, int n_threads);
+
+#endif
@@ -0,0 +1,92 @@
+#include <chrono>
+
+#include "histogram.h"
+#include "block_stats.h"
+
+static const char* stage_names[N_STAGES] = { "histogram", "tree", "table", "encode" };
+
+uint64_t stats_clock_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Everything except the stage times, from the block's histogram and code
+void fill_block_stats(block_stats_t* stats, const unsigned* freq, const huffman_code_t* codes, size_t n_table,
+    size_t raw_bytes, size_t encoded_bytes) {
+    stats->stored = false;
+    stats->raw_bytes = raw_bytes;
+    stats->encoded_bytes = encoded_bytes;
+    stats->n_table = n_table;
+    for (int l = 0; l <= HUFFMAN_MAX_CODE_LENGTH; l++) stats->length_histogram[l] = 0;
+    uint64_t bits = 0, hops = 0;
+    for (int s = 0; s < 256; s++) {
+        if (!freq[s]) continue;
+        short length = codes[s].length;
+        stats->length_histogram[length] += freq[s];
+        bits += (uint64_t) freq[s] * length;
+        hops += (uint64_t) freq[s] * ((length + 3) / 4);
+    }
+    double n = raw_bytes ? (double) raw_bytes : 1;
+    stats->entropy_bits = entropy_bits(freq) / n;
+    stats->achieved_bits = bits / n;
+    stats->hops = hops / n;
+}
+
+// A stored block costs 8 bits per symbol and no table hops
+void fill_stored_block_stats(block_stats_t* stats, const unsigned* freq, size_t raw_bytes) {
+    stats->stored = true;
+    stats->raw_bytes = raw_bytes;
+    stats->encoded_bytes = raw_bytes;
+    stats->n_table = 0;
+    for (int l = 0; l <= HUFFMAN_MAX_CODE_LENGTH; l++) stats->length_histogram[l] = 0;
+    stats->length_histogram[8] = raw_bytes;
+    stats->entropy_bits = raw_bytes ? entropy_bits(freq) / raw_bytes : 0;
+    stats->achieved_bits = 8;
+    stats->hops = 0;
+}
+
+// Longest code length used by any of the blocks
+static int max_used_length(const block_stats_t* stats, size_t n) {
+    int max_length = 0;
+    for (size_t i = 0; i < n; i++)
+        for (int l = max_length + 1; l <= HUFFMAN_MAX_CODE_LENGTH; l++)
+            if (stats[i].length_histogram[l]) max_length = l;
+    return max_length;
+}
+
+// One row per block. The code length histogram gets one column per length, up to the
+// longest one used.
+void write_block_stats_csv(FILE* file, const block_stats_t* stats, size_t n) {
+    int max_length = max_used_length(stats, n);
+    fprintf(file, "block,stored,raw_bytes,encoded_bytes,n_table,entropy_bits,achieved_bits,hops");
+    for (int s = 0; s < N_STAGES; s++) fprintf(file, ",%s_ns", stage_names[s]);
+    for (int l = 1; l <= max_length; l++) fprintf(file, ",length_%d", l);
+    fprintf(file, "\n");
+    for (size_t i = 0; i < n; i++) {
+        const block_stats_t* b = &stats[i];
+        fprintf(file, "%zu,%d,%zu,%zu,%zu,%.4f,%.4f,%.4f", i, b->stored, b->raw_bytes, b->encoded_bytes, b->n_table,
+            b->entropy_bits, b->achieved_bits, b->hops);
+        for (int s = 0; s < N_STAGES; s++) fprintf(file, ",%llu", (unsigned long long) b->stage_ns[s]);
+        for (int l = 1; l <= max_length; l++) fprintf(file, ",%u", b->length_histogram[l]);
+        fprintf(file, "\n");
+    }
+}
+
+// An array with one object per block
+void write_block_stats_json(FILE* file, const block_stats_t* stats, size_t n) {
+    int max_length = max_used_length(stats, n);
+    fprintf(file, "[\n");
+    for (size_t i = 0; i < n; i++) {
+        const block_stats_t* b = &stats[i];
+        fprintf(file, "  {\"block\": %zu, \"stored\": %s, \"raw_bytes\": %zu, \"encoded_bytes\": %zu, "
+            "\"n_table\": %zu, \"entropy_bits\": %.4f, \"achieved_bits\": %.4f, \"hops\": %.4f, ", i,
+            b->stored ? "true" : "false", b->raw_bytes, b->encoded_bytes, b->n_table, b->entropy_bits, b->achieved_bits,
+            b->hops);
+        for (int s = 0; s < N_STAGES; s++)
+            fprintf(file, "\"%s_ns\": %llu, ", stage_names[s], (unsigned long long) b->stage_ns[s]);
+        fprintf(file, "\"length_histogram\": [");
+        for (int l = 1; l <= max_length; l++) fprintf(file, "%s%u", l > 1 ? ", " : "", b->length_histogram[l]);
+        fprintf(file, "]}%s\n", i + 1 < n ? "," : "");
+    }
+    fprintf(file, "]\n");
+}
@@ -0,0 +1,51 @@
+#ifndef BLOCK_STATS_H_
+#define BLOCK_STATS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "table_gen.h"
+
+// Optional per-block statistics of the encoder, for deciding which traffic is worth
+// sending to the accelerator. Nothing is measured unless a block_stats_t is passed in,
+// so the cost when disabled is one pointer check per stage.
+
+enum block_stage_t {
+    STAGE_HISTOGRAM,
+    STAGE_TREE,
+    STAGE_TABLE,
+    STAGE_ENCODE,
+    N_STAGES
+};
+
+struct block_stats_t {
+    bool stored; // Copied as is (STREAM_FLAG_STORED_BLOCKS), with no tables and 8 bits per symbol
+    size_t raw_bytes;
+    size_t encoded_bytes; // Payload only
+    size_t n_table;
+    double entropy_bits; // Shannon bound per symbol
+    double achieved_bits; // Code bits per symbol (without the padding)
+    double hops; // Table hops per symbol, which is what the accelerator spends its cycles on
+    uint32_t length_histogram[HUFFMAN_MAX_CODE_LENGTH + 1]; // Symbols of the block coded with each length
+    // (the exports start at length 1)
+    uint64_t stage_ns[N_STAGES]; // Wall time of each stage
+};
+
+uint64_t stats_clock_ns();
+
+// Close the current stage: charge the time since *start to it and start the next one
+static inline void end_stage(block_stats_t* stats, block_stage_t stage, uint64_t* start) {
+    if (!stats) return;
+    uint64_t now = stats_clock_ns();
+    stats->stage_ns[stage] = now - *start;
+    *start = now;
+}
+
+void fill_block_stats(block_stats_t* stats, const unsigned* freq, const huffman_code_t* codes, size_t n_table,
+    size_t raw_bytes, size_t encoded_bytes);
+void fill_stored_block_stats(block_stats_t* stats, const unsigned* freq, size_t raw_bytes);
+void write_block_stats_csv(FILE* file, const block_stats_t* stats, size_t n);
+void write_block_stats_json(FILE* file, const block_stats_t* stats, size_t n);
+
+#endif
@@ -0,0 +1,112 @@
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "histogram.h"
+
+#ifdef HISTOGRAM_AVX2
+#include <immintrin.h>
+#endif
+
+// Below this size, clearing the sub-histograms costs more than it saves
+#define SMALL_INPUT 64
+
+// A single freq[data[i]]++ loop stalls whenever the same byte comes back before the
+// previous increment is stored (store-to-load forwarding), which happens all the time in text.
+// Spreading the bytes over 4 sub-histograms makes back-to-back repeats hit different counters.
+void count_frequency_scalar(const unsigned char* data, size_t length, unsigned* freq) {
+    unsigned counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        uint64_t words[2];
+        memcpy(words, data + i, 16);
+        for (int j = 0; j < 2; j++) {
+            uint64_t word = words[j];
+            counts[0][word & 0xff]++;
+            counts[1][(word >> 8) & 0xff]++;
+            counts[2][(word >> 16) & 0xff]++;
+            counts[3][(word >> 24) & 0xff]++;
+            counts[0][(word >> 32) & 0xff]++;
+            counts[1][(word >> 40) & 0xff]++;
+            counts[2][(word >> 48) & 0xff]++;
+            counts[3][word >> 56]++;
+        }
+    }
+    for (; i < length; i++) counts[0][data[i]]++;
+    for (int s = 0; s < 256; s++)
+        freq[s] = counts[0][s] + counts[1][s] + counts[2][s] + counts[3][s];
+}
+
+#ifdef HISTOGRAM_AVX2
+bool cpu_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+// AVX2 can't scatter the increments (that needs AVX-512 conflict detection), so it's used
+// where it helps: a 32-byte run of one byte (padding, spaces, zeros) is found with one
+// compare and counted with one add, and the sub-histograms are summed 8 counters at a time.
+__attribute__((target("avx2")))
+void count_frequency_avx2(const unsigned char* data, size_t length, unsigned* freq) {
+    alignas(32) unsigned counts[4][256];
+    memset(counts, 0, sizeof(counts));
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i first = _mm256_set1_epi8(data[i]);
+        if ((unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, first)) == 0xffffffffu) {
+            counts[0][data[i]] += 32;
+            continue;
+        }
+        uint64_t words[4];
+        memcpy(words, data + i, 32);
+        for (int j = 0; j < 4; j++) {
+            uint64_t word = words[j];
+            counts[0][word & 0xff]++;
+            counts[1][(word >> 8) & 0xff]++;
+            counts[2][(word >> 16) & 0xff]++;
+            counts[3][(word >> 24) & 0xff]++;
+            counts[0][(word >> 32) & 0xff]++;
+            counts[1][(word >> 40) & 0xff]++;
+            counts[2][(word >> 48) & 0xff]++;
+            counts[3][word >> 56]++;
+        }
+    }
+    for (; i < length; i++) counts[0][data[i]]++;
+    for (int s = 0; s < 256; s += 8) {
+        __m256i sum = _mm256_load_si256((const __m256i*) &counts[0][s]);
+        for (int k = 1; k < 4; k++)
+            sum = _mm256_add_epi32(sum, _mm256_load_si256((const __m256i*) &counts[k][s]));
+        _mm256_storeu_si256((__m256i*) &freq[s], sum);
+    }
+}
+#endif
+
+typedef void (*histogram_kernel_t)(const unsigned char*, size_t, unsigned*);
+
+static histogram_kernel_t select_kernel() {
+#ifdef HISTOGRAM_AVX2
+    if (cpu_has_avx2()) return count_frequency_avx2;
+#endif
+    return count_frequency_scalar;
+}
+
+void count_frequency(const unsigned char* data, size_t length, unsigned* freq) {
+    if (length < SMALL_INPUT) {
+        memset(freq, 0, 256 * sizeof(unsigned));
+        for (size_t i = 0; i < length; i++) freq[data[i]]++;
+        return;
+    }
+    static const histogram_kernel_t kernel = select_kernel();
+    kernel(data, length, freq);
+}
+
+// Shannon bound in bits of a block with this byte histogram
+double entropy_bits(const unsigned* freq) {
+    uint64_t total = 0;
+    for (int s = 0; s < 256; s++) total += freq[s];
+    double bits = 0;
+    for (int s = 0; s < 256; s++)
+        if (freq[s]) bits += freq[s] * log2((double) total / freq[s]);
+    return bits;
+}
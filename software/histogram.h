@@ -0,0 +1,22 @@
+#ifndef HISTOGRAM_H_
+#define HISTOGRAM_H_
+
+#include <stddef.h>
+
+// The AVX2 kernel is built with a target attribute and picked at runtime,
+// so the rest of the code doesn't need -mavx2.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HISTOGRAM_AVX2
+#endif
+
+// Byte frequency count. freq must have 256 entries and is overwritten.
+// count_frequency() picks the fastest kernel the CPU supports.
+void count_frequency(const unsigned char* data, size_t length, unsigned* freq);
+void count_frequency_scalar(const unsigned char* data, size_t length, unsigned* freq);
+double entropy_bits(const unsigned* freq);
+#ifdef HISTOGRAM_AVX2
+bool cpu_has_avx2();
+void count_frequency_avx2(const unsigned char* data, size_t length, unsigned* freq);
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+// Command line front end: encode files of any size block by block, either into a framed
+// block stream or into table / reference data stimulus for the hardware testbench.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "table_gen.h"
+#include "histogram.h"
+#include "software_model.h"
+#include "block_codec.h"
+#include "hw_model.h"
+#include "table_cache.h"
+#include "table_update.h"
+#include "block_stats.h"
+
+// Staging buffer for the reference data writer
+#define STAGING_SIZE (1 << 16)
+
+struct mapped_file_t {
+    const unsigned char* data;
+    size_t length;
+};
+
+// Map the whole file read only. The kernel pages it in as we go, so the size of the
+// input doesn't matter.
+static bool map_file(const char* filename, mapped_file_t* file) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        perror(filename);
+        close(fd);
+        return false;
+    }
+    file->length = st.st_size;
+    file->data = NULL;
+    if (file->length) {
+        void* data = mmap(NULL, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(filename);
+            close(fd);
+            return false;
+        }
+        madvise(data, file->length, MADV_SEQUENTIAL);
+        file->data = (const unsigned char*) data;
+    }
+    close(fd);
+    return true;
+}
+
+static void unmap_file(mapped_file_t* file) {
+    if (file->length) munmap((void*) file->data, file->length);
+}
+
+// Stimulus for the testbench. Every table image goes to table_file in the order they are
+// generated, and the payloads go back to back to ref_file. With a single block, this is what
+// table_gen used to write to data/table.dat and data/ref_data.dat. Blocks that reuse a cached
+// table don't write a new image; the index line says which one they use.
+static bool write_stimulus(const mapped_file_t* input, size_t block_size, table_cache_t* cache, FILE* table_file,
+    FILE* ref_file) {
+    unsigned char staging[STAGING_SIZE];
+    size_t ref_offset = 0;
+    for (size_t offset = 0, block = 0; offset < input->length; offset += block_size, block++) {
+        const unsigned char* data = input->data + offset;
+        size_t length = input->length - offset < block_size ? input->length - offset : block_size;
+        unsigned freq[256];
+        count_frequency(data, length, freq);
+        bool reused;
+        const table_cache_entry_t* entry = table_cache_get(cache, freq, &reused);
+        if (!reused && fwrite(entry->image, 1, TABLE_IMAGE_SIZE, table_file) != TABLE_IMAGE_SIZE) return false;
+
+        bit_writer_t writer;
+        bit_writer_init(&writer, entry->codes, staging, STAGING_SIZE, file_bit_sink, ref_file);
+        bit_writer_write(&writer, data, length);
+        size_t ref_length = bit_writer_flush(&writer);
+        printf("block %zu: raw %zu+%zu, ref %zu+%zu, table %llu%s, %zu tables\n", block, offset, length, ref_offset,
+            ref_length, (unsigned long long) entry->id, reused ? " (reused)" : "", entry->n_table);
+        ref_offset += ref_length;
+    }
+    return !ferror(ref_file);
+}
+
+// Run the pipeline models over every block and print the estimated accelerator cycles.
+// A new table costs one SynthMem line write per 8 bytes of its packed image body. With a
+// table state, every block after the first updates the tables in place and only costs the
+// lines that changed.
+static void estimate_cycles(const mapped_file_t* input, size_t block_size, table_cache_t* cache,
+    table_state_t* state) {
+    uint64_t encode_cycles = 0, decode_cycles = 0, load_cycles = 0;
+    for (size_t offset = 0, block = 0; offset < input->length; offset += block_size, block++) {
+        const unsigned char* data = input->data + offset;
+        size_t length = input->length - offset < block_size ? input->length - offset : block_size;
+        unsigned freq[256];
+        count_frequency(data, length, freq);
+        const huffman_code_t* codes;
+        size_t load;
+        if (state) {
+            if (block == 0) {
+                table_state_init(state, freq);
+                load = packed_table_body_size(state->n_table) / 8;
+            } else {
+                int delta[256];
+                for (int s = 0; s < 256; s++) delta[s] = (int) freq[s] - (int) state->freq[s];
+                load = table_state_update(state, delta, NULL);
+            }
+            codes = state->codes;
+        } else {
+            bool reused;
+            const table_cache_entry_t* entry = table_cache_get(cache, freq, &reused);
+            load = reused ? 0 : packed_table_body_size(entry->n_table) / 8;
+            codes = entry->codes;
+        }
+        pipeline_estimate_t encode, decode;
+        model_encoder(codes, data, length, &encode);
+        model_decoder(codes, data, length, &decode);
+        printf("block %zu: %zu bytes, %.2f hops/symbol, load %zu cycles, encode %llu cycles, decode %llu cycles\n",
+            block, length, (double) encode.hops / length, load, (unsigned long long) encode.cycles,
+            (unsigned long long) decode.cycles);
+        load_cycles += load;
+        encode_cycles += encode.cycles;
+        decode_cycles += decode.cycles;
+    }
+    if (input->length)
+        printf("total: load %llu cycles, encode %llu cycles (%.3f bytes/cycle), decode %llu cycles (%.3f bytes/cycle)\n",
+            (unsigned long long) load_cycles, (unsigned long long) encode_cycles, (double) input->length / encode_cycles,
+            (unsigned long long) decode_cycles, (double) input->length / decode_cycles);
+}
+
+// Decode a framed block stream one frame at a time
+static bool decode_stream(const mapped_file_t* input, FILE* output) {
+    unsigned flags;
+    if (!read_stream_header(input->data, input->length, &flags)) {
+        fprintf(stderr, "not a block stream\n");
+        return false;
+    }
+    unsigned char block[BLOCK_SIZE_MAX];
+    size_t pos = STREAM_HEADER_SIZE;
+    while (pos < input->length) {
+        const unsigned char* frame = input->data + pos;
+        size_t frame_length = block_frame_size(frame, input->length - pos, flags);
+        if (!frame_length) break;
+        // Empty blocks decode to 0 bytes as well, so check the raw length in the header
+        size_t raw_length = decode_block(frame, frame_length, block, BLOCK_SIZE_MAX, flags);
+        if (!raw_length && block_raw_length(frame)) break;
+        fwrite(block, 1, raw_length, output);
+        pos += frame_length;
+    }
+    if (pos != input->length) {
+        fprintf(stderr, "broken frame at %zu\n", pos);
+        return false;
+    }
+    return !ferror(output);
+}
+
+static bool write_stats(const char* filename, const std::vector<block_stats_t>& stats) {
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        perror(filename);
+        return false;
+    }
+    size_t name_length = strlen(filename);
+    if (name_length >= 5 && !strcmp(filename + name_length - 5, ".json"))
+        write_block_stats_json(file, stats.data(), stats.size());
+    else
+        write_block_stats_csv(file, stats.data(), stats.size());
+    return fclose(file) == 0;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr,
+        "usage: %s [options] input\n"
+        "  -o FILE   write a framed block stream (or the decoded data with -d)\n"
+        "  -t FILE   write the table images for the testbench (table.dat)\n"
+        "  -r FILE   write the reference encoded data for the testbench (ref_data.dat)\n"
+        "  -b SIZE   block size in bytes, at most %d (default)\n"
+        "  -j N      number of threads for -o (default: one per hardware thread)\n"
+        "  -i        with -o, split every block into %d interleaved bitstreams\n"
+        "  -S FILE   with -o, write per-block statistics (JSON if FILE ends in .json, CSV otherwise)\n"
+        "  -g PCT    with -o, store blocks that coding would shrink by less than PCT%% (default %g, -1 to code all)\n"
+        "  -d        decode the framed block stream in input\n"
+        "  -c        print the estimated accelerator cycles of every block\n"
+        "  -s PCT    with -t/-r or -c, reuse a recent table if it costs at most PCT%% more bits\n"
+        "  -u        with -c, update the tables in place between blocks and count only the changed lines\n",
+        name, BLOCK_SIZE_MAX, INTERLEAVED_STREAMS, STORED_BLOCK_MIN_GAIN * 100);
+}
+
+int main(int argc, char** argv) {
+    const char* stream_name = NULL;
+    const char* table_name = NULL;
+    const char* ref_name = NULL;
+    size_t block_size = BLOCK_SIZE_MAX;
+    int n_threads = 0;
+    bool decode = false;
+    bool interleaved = false;
+    bool estimate = false;
+    bool incremental = false;
+    const char* stats_name = NULL;
+    double max_penalty = -1;
+    double min_gain = STORED_BLOCK_MIN_GAIN;
+    int opt;
+    while ((opt = getopt(argc, argv, "o:t:r:b:j:iS:g:dcs:uh")) != -1) {
+        switch (opt) {
+            case 'o': stream_name = optarg; break;
+            case 't': table_name = optarg; break;
+            case 'r': ref_name = optarg; break;
+            case 'b': block_size = strtoul(optarg, NULL, 0); break;
+            case 'j': n_threads = atoi(optarg); break;
+            case 'i': interleaved = true; break;
+            case 'S': stats_name = optarg; break;
+            case 'g': min_gain = atof(optarg) / 100; break;
+            case 'd': decode = true; break;
+            case 'c': estimate = true; break;
+            case 's': max_penalty = atof(optarg) / 100; break;
+            case 'u': incremental = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || (!stream_name && !table_name && !ref_name && !estimate) || (!table_name != !ref_name)
+        || (decode && !stream_name) || block_size == 0 || block_size > BLOCK_SIZE_MAX) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    mapped_file_t input;
+    if (!map_file(argv[optind], &input)) return 1;
+    bool ok = true;
+    table_cache_t* cache = new table_cache_t;
+
+    if (stream_name) {
+        FILE* output = fopen(stream_name, "wb");
+        if (!output) {
+            perror(stream_name);
+            unmap_file(&input);
+            delete cache;
+            return 1;
+        }
+        if (decode) {
+            ok = decode_stream(&input, output);
+        } else {
+            struct block_options_t options;
+            options.block_size = block_size;
+            options.n_threads = n_threads;
+            options.interleaved = interleaved;
+            std::vector<block_stats_t> stats;
+            options.stats = stats_name ? &stats : NULL;
+            options.min_gain = min_gain;
+            size_t n_written = encode_blocks(input.data, input.length, output, &options);
+            ok = n_written >= STREAM_HEADER_SIZE && !ferror(output);
+            printf("%zu -> %zu bytes\n", input.length, n_written);
+            if (stats_name) ok = write_stats(stats_name, stats) && ok;
+        }
+        ok = fclose(output) == 0 && ok;
+    }
+
+    if (table_name && !decode) {
+        FILE* table_file = fopen(table_name, "wb");
+        FILE* ref_file = table_file ? fopen(ref_name, "wb") : NULL;
+        if (!table_file || !ref_file) {
+            perror(table_file ? ref_name : table_name);
+            if (table_file) fclose(table_file);
+            unmap_file(&input);
+            delete cache;
+            return 1;
+        }
+        table_cache_init(cache, max_penalty);
+        ok = write_stimulus(&input, block_size, cache, table_file, ref_file) && ok;
+        ok = fclose(table_file) == 0 && ok;
+        ok = fclose(ref_file) == 0 && ok;
+    }
+
+    if (estimate && !decode) {
+        table_cache_init(cache, max_penalty);
+        table_state_t* state = incremental ? new table_state_t : NULL;
+        estimate_cycles(&input, block_size, cache, state);
+        delete state;
+    }
+
+    unmap_file(&input);
+    delete cache;
+    if (!ok) fprintf(stderr, "%s: failed\n", argv[0]);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+
+#include "table_gen.h"
+#include "hw_model.h"
+
+// Number of tables a code of this length goes through
+static inline int code_hops(short length) {
+    return (length + 3) / 4;
+}
+
+// Estimate the encoder run over data with the given code table.
+// Cycle T = ENCODE_STARTUP_CYCLES + 2 * k processes hop k and requests the next one, so
+// EncodeShiftBuffer gets at most 4 bits every other cycle and can always send a byte when it
+// holds 9 bits or more. Nothing in the encoder ever stalls; the buffer is tracked for its
+// occupancy and the drain at the end.
+void model_encoder(const huffman_code_t* codes, const unsigned char* data, size_t length,
+    pipeline_estimate_t* estimate) {
+    memset(estimate, 0, sizeof(*estimate));
+    // The hardware ignores requests of length 0
+    if (!length) return;
+
+    int n_bits = 0;
+    uint64_t cycle = ENCODE_STARTUP_CYCLES;
+    // The first lut_request cycle of the loop has nothing to process
+    estimate->table_reads = 2;
+    for (size_t i = 0; i < length; i++) {
+        short code_length = codes[data[i]].length;
+        int hops = code_hops(code_length);
+        for (int h = 0; h < hops; h++) {
+            // next_table cycle: only the output side moves
+            cycle++;
+            if (n_bits > 8) {
+                n_bits -= 8;
+                estimate->output_bytes++;
+            }
+            // max_lut cycle: the hop is done and its bits go into the buffer
+            cycle++;
+            if (n_bits > 8) {
+                n_bits -= 8;
+                estimate->output_bytes++;
+            }
+            n_bits += h == hops - 1 ? code_length - 4 * h : 4;
+            if (n_bits > estimate->max_buffer_bits) estimate->max_buffer_bits = n_bits;
+            estimate->table_reads += 3;
+        }
+        estimate->hops += hops;
+    }
+    // Drain the full bytes, then flush the partial byte
+    for (; n_bits > 8; n_bits -= 8) {
+        cycle++;
+        estimate->output_bytes++;
+    }
+    if (n_bits) {
+        cycle++;
+        estimate->output_bytes++;
+    }
+    estimate->cycles = cycle + ENCODE_DRAIN_CYCLES;
+    estimate->symbols = length;
+    estimate->order_reads = length;
+    estimate->sp_reads = length;
+}
+
+// Estimate the decoder run over the stream that encodes data with the given code table.
+// Only the bit counts matter for timing, so the original data and code lengths are enough.
+// A hop is issued when the head of DecodeShiftBuffer holds all the bits it will consume
+// (the RTL issues as soon as any bit is valid, which only gives the right answer in that case),
+// and its result shifts the buffer in the next cycle.
+void model_decoder(const huffman_code_t* codes, const unsigned char* data, size_t length,
+    pipeline_estimate_t* estimate) {
+    memset(estimate, 0, sizeof(*estimate));
+    if (!length) return;
+
+    int n_bits = 0;
+    int in_flight = 0; // Bits the hop issued last cycle will shift out, 0 if none
+    bool started = false;
+    size_t i = 0;
+    int hop = 0; // Next hop of symbol i
+    uint64_t cycle = 0;
+    while (in_flight || i < length) {
+        cycle++;
+        // The hop issued last cycle comes back and shifts the buffer
+        if (in_flight) {
+            n_bits -= in_flight;
+            in_flight = 0;
+        }
+        // Issue the next hop with the bits left at the head of the buffer
+        if (i < length) {
+            short code_length = codes[data[i]].length;
+            int hops = code_hops(code_length);
+            int shamt = hop == hops - 1 ? code_length - 4 * hop : 4;
+            if (n_bits >= shamt) {
+                in_flight = shamt;
+                started = true;
+                estimate->table_reads += 2;
+                estimate->hops++;
+                if (++hop == hops) {
+                    hop = 0;
+                    i++;
+                }
+            } else if (started) {
+                estimate->stall_cycles++;
+            }
+        }
+        // Refill a byte once the pipeline from the scratchpad is primed
+        if (cycle >= DECODE_REFILL_LATENCY && n_bits <= 8) {
+            n_bits += 8;
+            estimate->sp_reads++;
+        }
+        if (n_bits > estimate->max_buffer_bits) estimate->max_buffer_bits = n_bits;
+    }
+    estimate->cycles = cycle + DECODE_DRAIN_CYCLES;
+    estimate->symbols = length;
+    estimate->order_reads = length;
+    estimate->output_bytes = length;
+}
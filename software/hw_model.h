@@ -0,0 +1,58 @@
+#ifndef HW_MODEL_H_
+#define HW_MODEL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cycle-approximate model of HuffmanEncoder / HuffmanDecoder (src/main/scala/huffman/Huffman.scala).
+// It replays the main loop hop by hop instead of simulating the RTL, so it runs at software
+// encoder speed and can be used to size a deployment from real blocks.
+//
+// The timing follows the RTL:
+// - Encoder: every table hop takes 2 cycles, one to read both max_lut lines and one to read
+//   next_table (they share table_port(0)). The symbol fetch and canonical lookup are
+//   pipelined behind the loop, so the next symbol starts right after the last hop.
+// - Decoder: one hop per cycle. The table reads are issued with the bits at the head of
+//   DecodeShiftBuffer, and the result shifts it in the next cycle while the next hop is issued.
+//   The buffer takes a byte from the scratchpad whenever at most 8 bits are left.
+// - A symbol with a code of length L visits ceil(L / 4) tables (4 bits per table).
+
+// Calibration: HuffmanTester on data/sample_data.txt (1000 bytes, 523 bytes encoded) counts
+// 2482 cycles for the encoder and 1246 for the decoder (Treadle run reported in huffman.pdf,
+// counted from the cycle after req.fire until req.ready, so with some test overhead).
+// The hop timing alone gives 2476 and 1240: both are 6 cycles short, so the per-hop rates
+// hold and the difference is fixed per request. One run can't tell startup from drain, so
+// the 6 cycles go to the drain constants. test_hw_model() checks both counts.
+
+// Cycles from req.fire to the first table read of the main loop
+#define ENCODE_STARTUP_CYCLES 4
+// Cycles from the last hop until the final flush of EncodeShiftBuffer is done and the
+// encoder is ready again (fitted to the 2482 measured cycles)
+#define ENCODE_DRAIN_CYCLES 8
+// Cycles from req.fire until the first refill byte enters DecodeShiftBuffer
+#define DECODE_REFILL_LATENCY 3
+// Cycles from the last hop until the last symbol leaves the order table and the decoder is
+// ready again (fitted to the 1246 measured cycles)
+#define DECODE_DRAIN_CYCLES 8
+
+#define ENCODE_BUFFER_BITS 12
+#define DECODE_BUFFER_BITS 16
+
+struct pipeline_estimate_t {
+    uint64_t cycles; // From req.fire until the module is ready again
+    uint64_t symbols;
+    uint64_t hops; // Tables visited by the main loop
+    uint64_t table_reads; // Reads on table_port(0) and table_port(1)
+    uint64_t order_reads; // Reads on order_table_port
+    uint64_t sp_reads; // Scratchpad reads (one byte each)
+    uint64_t output_bytes; // Bytes on io.resp
+    uint64_t stall_cycles; // Main loop cycles spent waiting for the shift buffer
+    int max_buffer_bits; // Peak occupancy of the shift buffer
+};
+
+void model_encoder(const struct huffman_code_t* codes, const unsigned char* data, size_t length,
+    pipeline_estimate_t* estimate);
+void model_decoder(const struct huffman_code_t* codes, const unsigned char* data, size_t length,
+    pipeline_estimate_t* estimate);
+
+#endif
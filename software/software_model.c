@@ -1,7 +1,14 @@
 // Software model of the Huffman encoder / decoder.
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "table_gen.h"
+#include "histogram.h"
+#include "software_model.h"
 
 // Bitstream, return true if flushed
 void output_bitstream(unsigned char** pos, short* bit_pos, unsigned char* buf, bool bit) {
@@ -15,50 +22,449 @@ void output_bitstream(unsigned char** pos, short* bit_pos, unsigned char* buf, b
     }
 }
 
+// Hand the bytes written so far to the sink and start over at the beginning of the buffer.
+static void drain_bits(bit_writer_t* writer) {
+    size_t n = writer->pos - writer->begin;
+    if (n) writer->sink(writer->context, writer->begin, n);
+    writer->n_drained += n;
+    writer->pos = writer->begin;
+}
+
+// Write the low 32 bits of word, big endian. Without a sink, once the buffer is full
+// whatever fits is written and the rest is dropped.
+static inline void put_word(bit_writer_t* writer, uint32_t word) {
+    if (writer->end - writer->pos < 4) {
+        if (writer->sink) drain_bits(writer);
+        else {
+            for (int shamt = 24; writer->pos < writer->end; shamt -= 8) *writer->pos++ = word >> shamt;
+            writer->overflow = true;
+            return;
+        }
+    }
+    word = __builtin_bswap32(word);
+    memcpy(writer->pos, &word, 4);
+    writer->pos += 4;
+}
+
+// Set up a writer over buffer. With a sink, the buffer is only a staging area: it's handed
+// to the sink whenever it fills up, so it can be much smaller than the output (at least
+// 4 bytes). Without a sink, buffer is the destination and size is the limit.
+void bit_writer_init(bit_writer_t* writer, const huffman_code_t* codes, unsigned char* buffer, size_t size,
+    bit_sink_t sink, void* context) {
+    writer->codes = codes;
+    writer->acc = 0;
+    writer->n_bits = 0;
+    writer->begin = buffer;
+    writer->pos = buffer;
+    writer->end = buffer + size;
+    writer->sink = sink;
+    writer->context = context;
+    writer->n_drained = 0;
+    writer->overflow = false;
+}
+
+// Shift one code into the accumulator and write out every full 32-bit word.
+// Every shift stays under 32 bits so the accumulator never overflows.
+static inline void put_code(bit_writer_t* writer, uint64_t* acc, int* n_bits, const huffman_code_t* code) {
+    uint64_t bits = code->code;
+    int len = code->length;
+    if (len > 32) {
+        *acc = (*acc << (len - 32)) | (bits >> 32);
+        *n_bits += len - 32;
+        bits &= 0xffffffff;
+        len = 32;
+        if (*n_bits >= 32) {
+            *n_bits -= 32;
+            put_word(writer, *acc >> *n_bits);
+        }
+    }
+    *acc = (*acc << len) | bits;
+    *n_bits += len;
+    if (*n_bits >= 32) {
+        *n_bits -= 32;
+        put_word(writer, *acc >> *n_bits);
+    }
+}
+
+// Encode the next length symbols. Whole codes are shifted into a 64-bit accumulator
+// and written out 32 bits at a time, in symbol order.
+void bit_writer_write(bit_writer_t* writer, const unsigned char* data, size_t length) {
+    uint64_t acc = writer->acc;
+    int n_bits = writer->n_bits; // Number of bits in acc not written yet (always < 32 between symbols)
+    for (size_t i = 0; i < length && !writer->overflow; i++)
+        put_code(writer, &acc, &n_bits, &writer->codes[data[i]]);
+    writer->acc = acc;
+    writer->n_bits = n_bits;
+}
+
+// Same as bit_writer_write() for alphabets over 256 symbols
+void bit_writer_write_symbols(bit_writer_t* writer, const unsigned short* symbols, size_t length) {
+    uint64_t acc = writer->acc;
+    int n_bits = writer->n_bits;
+    for (size_t i = 0; i < length && !writer->overflow; i++)
+        put_code(writer, &acc, &n_bits, &writer->codes[symbols[i]]);
+    writer->acc = acc;
+    writer->n_bits = n_bits;
+}
+
+// Write the remaining bits, left aligned in the last byte (padded with 0), and hand
+// everything left to the sink. The writer can be used again afterwards, starting on a
+// byte boundary. Return the number of bytes written since init.
+size_t bit_writer_flush(bit_writer_t* writer) {
+    uint64_t acc = writer->acc << 8;
+    for (int n_bits = writer->n_bits; n_bits > 0 && !writer->overflow; n_bits -= 8) {
+        if (writer->pos == writer->end) {
+            if (writer->sink) drain_bits(writer);
+            else {
+                writer->overflow = true;
+                break;
+            }
+        }
+        *writer->pos++ = acc >> n_bits;
+    }
+    writer->acc = 0;
+    writer->n_bits = 0;
+    if (writer->sink) drain_bits(writer);
+    return writer->n_drained + (writer->pos - writer->begin);
+}
+
+// Sink for bit_writer_t writing to a FILE*
+void file_bit_sink(void* file, const unsigned char* data, size_t length) {
+    fwrite(data, 1, length, (FILE*) file);
+}
+
+// Encode data with a flat code table straight into output.
+// Return the number of bytes written. The last byte is padded with 0.
+size_t encode_huffman(const huffman_code_t* codes, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit) {
+    bit_writer_t writer;
+    bit_writer_init(&writer, codes, output, limit, NULL, NULL);
+    bit_writer_write(&writer, data, length);
+    size_t output_length = bit_writer_flush(&writer);
+    if (writer.overflow) fprintf(stderr, "Huffman limit hit");
+    return output_length;
+}
+
+// One hop of HuffmanEncoder: compare the canonical symbol against the 16 max symbols of
+// the table (lower_max_lut entries first), like its 16 comparators. Return a mask with bit i
+// set if order <= max symbol i, and set *equal to the mask of order == max symbol i.
+// On x86, both are one SSE2 compare and movemask over the table's two max_lut lines.
+static inline unsigned compare_max_symbols(const struct table_root_t* table, unsigned table_idx, unsigned order,
+    unsigned* equal) {
+#ifdef __SSE2__
+    __m128i max = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*) (table->lower_max_lut + table_idx * 8)),
+        _mm_loadl_epi64((const __m128i*) (table->upper_max_lut + table_idx * 8)));
+    __m128i symbol = _mm_set1_epi8((char) order);
+    *equal = _mm_movemask_epi8(_mm_cmpeq_epi8(max, symbol));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(max, symbol), symbol));
+#else
+    unsigned le = 0;
+    *equal = 0;
+    for (unsigned i = 0; i < 16; i++) {
+        unsigned max = (i & 8 ? table->upper_max_lut : table->lower_max_lut)[table_idx * 8 + (i & 7)];
+        le |= (order <= max) << i;
+        *equal |= (order == max) << i;
+    }
+    return le;
+#endif
+}
+
+// Find the code of a symbol the way HuffmanEncoder does. The entries of a table are in
+// increasing order, so the first one whose max symbol is not below the canonical symbol is
+// the child to go to (match_child). If it points to another table, its 4 bits are sent and
+// the walk goes on there. Otherwise it's the leaf, and it covers as many entries as hold
+// its max symbol, a power of two: with 2^k of them the code takes 4 - k bits of the entry.
+// Broken tables end the walk at HUFFMAN_MAX_CODE_LENGTH bits instead of looping.
+static inline void table_code(const struct table_root_t* table, unsigned order, huffman_code_t* code) {
+    unsigned table_idx = 0;
+    code->code = 0;
+    code->length = 0;
+    while (code->length < HUFFMAN_MAX_CODE_LENGTH) {
+        unsigned equal;
+        unsigned child = __builtin_ctz(compare_max_symbols(table, table_idx, order, &equal) | 1 << 15);
+        table_idx = table->next_table[table_idx * 16 + child];
+        if (table_idx) {
+            code->code = code->code << 4 | child;
+            code->length += 4;
+            continue;
+        }
+        int length = 4 - __builtin_ctz(__builtin_popcount(equal) | 16);
+        code->code = code->code << length | child >> (4 - length);
+        code->length += length;
+        break;
+    }
+}
+
+// Encode data from the lookup tables alone, the same way HuffmanEncoder does, hop by hop.
+// This is the software twin of the accelerator for byte alphabets: it takes the tables in
+// the same image the hardware reads (e.g. one mapped with map_packed_table_image()) and
+// writes exactly what encode_huffman() does with the codes of those tables.
+// Return the number of bytes written. The last byte is padded with 0.
+size_t encode_huffman_tables(const struct table_root_t* table, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit) {
+    bit_writer_t writer;
+    bit_writer_init(&writer, NULL, output, limit, NULL, NULL);
+    uint64_t acc = 0;
+    int n_bits = 0;
+    for (size_t i = 0; i < length && !writer.overflow; i++) {
+        huffman_code_t code;
+        table_code(table, table->canonical_lut[data[i]], &code);
+        put_code(&writer, &acc, &n_bits, &code);
+    }
+    writer.acc = acc;
+    writer.n_bits = n_bits;
+    size_t output_length = bit_writer_flush(&writer);
+    if (writer.overflow) fprintf(stderr, "Huffman limit hit");
+    return output_length;
+}
+
 // Generate Huffman tree reference model
 size_t generate_huffman_ref(const unsigned char* data, size_t length, unsigned char* output, size_t limit, struct table_root_t* table, 
     size_t* n_table) {
-    size_t n_output_bits = 0;
-    huffman_t* encode_table[256];
     // Build frequency table
-    unsigned freq[256] = {0};
-    for (size_t i = 0; i < length; i++) freq[data[i]]++;
+    unsigned freq[256];
+    count_frequency(data, length, freq);
     // Generate table
-    huffman_t* root = build_huffman_tree(freq, 256, encode_table);
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
     // DEBUG: Enable this only if printing the tikz output for paper
-    print_huffman_tree(root);
+    // print_huffman_tree(root);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
     // Encode string
-    unsigned char* output_pos = &output[limit - 1];
-    unsigned char bit_buffer = 0;
-    short bit_pos = 0;
-    for (int i = length - 1; i >= 0; i--) {
-        // Going up from the leaf node and shift in the huffman code bit (in reverse order)
-        // We start from the last symbol and output it to the end of the region
-        huffman_t* node = encode_table[data[i]];
-        while (node->parent) {
-            // Stop if we hit the limit
-            if (output_pos < output) {
-                fprintf(stderr, "Huffman limit hit");    
-                goto break_outer;
+    size_t output_length = encode_huffman(codes, data, length, output, limit);
+    // Run table generation on the same tree
+    if (table && n_table)
+        *n_table = generate_table_from_tree(table, root);
+    return output_length;
+}
+
+// 64-bit bit reservoir for the decoder. The bits are consumed MSB first, which is
+// the same order DecodeShiftBuffer shifts them out.
+struct bit_reader_t {
+    const unsigned char* pos;
+    const unsigned char* end;
+    uint64_t buf; // Valid bits are left aligned
+    int count; // Number of valid bits in buf
+    size_t n_padding; // Zero bytes fed after we run out of input
+};
+
+// Top up the reservoir to at least 56 bits. In the middle of the stream we load
+// 8 bytes at once and only advance by the whole bytes that fit; the extra bits
+// loaded below count are the real next bits, so loading them again is harmless.
+static inline void refill_bits(bit_reader_t* reader) {
+    if (reader->end - reader->pos >= 8) {
+        uint64_t word;
+        memcpy(&word, reader->pos, 8);
+        reader->buf |= __builtin_bswap64(word) >> reader->count;
+        reader->pos += (63 - reader->count) >> 3;
+        reader->count |= 56;
+    } else {
+        // Near the end, feed byte by byte. Past the end, the hardware reads
+        // whatever is on the scratchpad; we read 0.
+        while (reader->count <= 56) {
+            uint64_t byte = 0;
+            if (reader->pos < reader->end) byte = *reader->pos++;
+            else reader->n_padding++;
+            reader->buf |= byte << (56 - reader->count);
+            reader->count += 8;
+        }
+    }
+}
+
+// Max canonical symbol of entry (0-7) of a max_lut half. For alphabets over 256 symbols
+// the high bits come from the table's cutoffs, like the hardware would add them.
+static inline unsigned max_entry(const unsigned char* max_lut, const unsigned char* cutoff, unsigned half,
+    unsigned entry) {
+    unsigned symbol = max_lut[entry];
+    if (cutoff) symbol |= cutoff_bits(cutoff, half | entry) << 8;
+    return symbol;
+}
+
+// Walk the tables for one symbol and return its canonical symbol.
+// Every hop looks at the next 4 bits, reads the next table index and the max canonical
+// symbol of the entry, and shifts out 1-4 bits. Like the hardware, the number of bits
+// to shift is found by checking whether the neighbouring entries hold the same max
+// symbol (i.e. they are the "projection" of one leaf). An entry pointing to another
+// table never matches its neighbour, so it always shifts 4 bits.
+static inline unsigned decode_canon(const struct table_root_t* table, bit_reader_t* reader, bool extended) {
+    unsigned table_idx = 0;
+    unsigned canon;
+    do {
+        if (reader->count < 4) refill_bits(reader);
+        unsigned code = reader->buf >> 60;
+        const unsigned char* max_lut = (code & 8 ? table->upper_max_lut : table->lower_max_lut) + table_idx * 8;
+        const unsigned char* cutoff = extended ? table->cutoff_lut + table_idx * 2 : NULL;
+        unsigned half = code & 8;
+        unsigned entry = code & 7;
+        // Same as symbol_shift in HuffmanDecoder, but counted as a sum instead of a priority encoder
+        int shamt = 1 + (max_entry(max_lut, cutoff, half, 0) != max_entry(max_lut, cutoff, half, 7))
+            + (max_entry(max_lut, cutoff, half, entry & 4) != max_entry(max_lut, cutoff, half, entry | 3))
+            + (max_entry(max_lut, cutoff, half, entry & 6) != max_entry(max_lut, cutoff, half, entry | 1));
+        canon = max_entry(max_lut, cutoff, half, entry);
+        table_idx = table->next_table[table_idx * 16 + code];
+        reader->buf <<= shamt;
+        reader->count -= shamt;
+    } while (table_idx);
+    return canon;
+}
+
+static void init_bit_reader(bit_reader_t* reader, const unsigned char* input, size_t length) {
+    reader->pos = input;
+    reader->end = input + length;
+    reader->buf = 0;
+    reader->count = 0;
+    reader->n_padding = 0;
+}
+
+// Number of whole bytes the reader went through, counting the padding
+static size_t bytes_read(const bit_reader_t* reader, const unsigned char* input) {
+    size_t n_bits = (reader->pos - input + reader->n_padding) * 8 - reader->count;
+    return (n_bits + 7) / 8;
+}
+
+// Decode n_symbols symbols with the same tables HuffmanDecoder reads.
+// Return the number of input bytes consumed. If the stream is truncated, the missing bits
+// are read as 0 and the returned size will be larger than length.
+size_t decode_huffman(const struct table_root_t* table, const unsigned char* input, size_t length,
+    unsigned char* output, size_t n_symbols) {
+    bit_reader_t reader;
+    init_bit_reader(&reader, input, length);
+    for (size_t i = 0; i < n_symbols; i++)
+        output[i] = table->canonical_decode_lut[decode_canon(table, &reader, false)];
+    return bytes_read(&reader, input);
+}
+
+// Decode the symbols of one single-lookup entry, or one symbol with the table walk if the
+// next code is too long for it. Writes all FAST_DECODE_MAX_SYMBOLS slots at output.
+// Return the number of symbols decoded.
+static inline size_t decode_fast_step(const struct table_root_t* table, const fast_decode_table_t* fast,
+    bit_reader_t* reader, unsigned char* output) {
+    if (reader->count < FAST_DECODE_BITS) refill_bits(reader);
+    const fast_decode_entry_t* entry = &fast->entries[reader->buf >> (64 - FAST_DECODE_BITS)];
+    if (!entry->n_symbols) {
+        output[0] = table->canonical_decode_lut[decode_canon(table, reader, false)];
+        return 1;
+    }
+    memcpy(output, entry->symbols, FAST_DECODE_MAX_SYMBOLS);
+    reader->buf <<= entry->n_bits;
+    reader->count -= entry->n_bits;
+    return entry->n_symbols;
+}
+
+// Same as decode_huffman(), but up to FAST_DECODE_MAX_SYMBOLS symbols at a time from the
+// single-lookup table. Codes longer than FAST_DECODE_BITS fall back to the table walk.
+size_t decode_huffman_fast(const struct table_root_t* table, const fast_decode_table_t* fast,
+    const unsigned char* input, size_t length, unsigned char* output, size_t n_symbols) {
+    bit_reader_t reader;
+    init_bit_reader(&reader, input, length);
+    size_t i = 0;
+    // Every entry writes all its symbol slots, so stop while there is room for them
+    while (i + FAST_DECODE_MAX_SYMBOLS <= n_symbols)
+        i += decode_fast_step(table, fast, &reader, output + i);
+    for (; i < n_symbols; i++)
+        output[i] = table->canonical_decode_lut[decode_canon(table, &reader, false)];
+    return bytes_read(&reader, input);
+}
+
+static inline void write_le32(unsigned char* dst, uint32_t value) {
+    for (int i = 0; i < 4; i++) dst[i] = value >> (8 * i);
+}
+
+static inline uint32_t read_le32(const unsigned char* src) {
+    return src[0] | src[1] << 8 | src[2] << 16 | (uint32_t) src[3] << 24;
+}
+
+// First symbol of stream s when n_symbols are split into INTERLEAVED_STREAMS streams
+static inline size_t interleaved_begin(size_t n_symbols, int s) {
+    size_t segment = (n_symbols + INTERLEAVED_STREAMS - 1) / INTERLEAVED_STREAMS;
+    return s * segment < n_symbols ? s * segment : n_symbols;
+}
+
+// Encode data as INTERLEAVED_STREAMS independent bitstreams behind a jump table, so a
+// decoder can follow all of them at once. Return the number of bytes written.
+size_t encode_huffman_interleaved(const huffman_code_t* codes, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit) {
+    if (limit < INTERLEAVED_JUMP_TABLE_SIZE) {
+        fprintf(stderr, "Huffman limit hit");
+        return 0;
+    }
+    size_t pos = INTERLEAVED_JUMP_TABLE_SIZE;
+    for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+        size_t begin = interleaved_begin(length, s);
+        size_t end = interleaved_begin(length, s + 1);
+        size_t stream_length = encode_huffman(codes, data + begin, end - begin, output + pos, limit - pos);
+        if (s < INTERLEAVED_STREAMS - 1) write_le32(output + 4 * s, stream_length);
+        pos += stream_length;
+    }
+    return pos;
+}
+
+// Decode the output of encode_huffman_interleaved(). The streams are advanced in turn, so
+// their table lookups don't depend on each other and overlap in the pipeline. fast can be
+// NULL to decode with the table walk only.
+// Return the number of input bytes consumed, or 0 if the jump table doesn't fit in length.
+size_t decode_huffman_interleaved(const struct table_root_t* table, const fast_decode_table_t* fast,
+    const unsigned char* input, size_t length, unsigned char* output, size_t n_symbols) {
+    if (length < INTERLEAVED_JUMP_TABLE_SIZE) return 0;
+    bit_reader_t readers[INTERLEAVED_STREAMS];
+    size_t pos[INTERLEAVED_STREAMS];
+    size_t end[INTERLEAVED_STREAMS];
+    size_t offset = INTERLEAVED_JUMP_TABLE_SIZE;
+    size_t last_offset = 0;
+    for (int s = 0; s < INTERLEAVED_STREAMS; s++) {
+        last_offset = offset;
+        size_t stream_length = s < INTERLEAVED_STREAMS - 1 ? read_le32(input + 4 * s) : length - offset;
+        if (stream_length > length - offset) return 0;
+        init_bit_reader(&readers[s], input + offset, stream_length);
+        offset += stream_length;
+        pos[s] = interleaved_begin(n_symbols, s);
+        end[s] = interleaved_begin(n_symbols, s + 1);
+    }
+
+    // A round takes at most FAST_DECODE_MAX_SYMBOLS symbols from every stream (and writes
+    // that many slots), so check the room left only once per batch of rounds
+    for (;;) {
+        size_t room = end[0] - pos[0];
+        for (int s = 1; s < INTERLEAVED_STREAMS; s++)
+            if (end[s] - pos[s] < room) room = end[s] - pos[s];
+        size_t n_rounds = room / FAST_DECODE_MAX_SYMBOLS;
+        if (!n_rounds) break;
+        static_assert(INTERLEAVED_STREAMS == 4, "the loop below is unrolled for 4 streams");
+        if (fast) {
+            for (size_t r = 0; r < n_rounds; r++) {
+                pos[0] += decode_fast_step(table, fast, &readers[0], output + pos[0]);
+                pos[1] += decode_fast_step(table, fast, &readers[1], output + pos[1]);
+                pos[2] += decode_fast_step(table, fast, &readers[2], output + pos[2]);
+                pos[3] += decode_fast_step(table, fast, &readers[3], output + pos[3]);
             }
-            bool bit = node->parent->right == node;
-            output_bitstream(&output_pos, &bit_pos, &bit_buffer, bit);
-            node = node->parent;
-            n_output_bits++;
+        } else {
+            for (size_t r = 0; r < n_rounds * FAST_DECODE_MAX_SYMBOLS; r++)
+                for (int s = 0; s < INTERLEAVED_STREAMS; s++)
+                    output[pos[s]++] = table->canonical_decode_lut[decode_canon(table, &readers[s], false)];
         }
     }
-break_outer:
-    // Align the string with the beginning of the output region
-    unsigned char* align_pos = output;
-    while (++output_pos < &output[limit]) { // We will align the last byte manually
-        // Shift the content from the next byte in
-        *align_pos++ = bit_buffer | (*((unsigned char*) output_pos) >> bit_pos);
-        // Load the byte not used by 
-        bit_buffer = *((unsigned char*) output_pos) << (8 - bit_pos);
+    for (int s = 0; s < INTERLEAVED_STREAMS; s++)
+        for (; pos[s] < end[s]; pos[s]++)
+            output[pos[s]] = table->canonical_decode_lut[decode_canon(table, &readers[s], false)];
+    return last_offset + bytes_read(&readers[INTERLEAVED_STREAMS - 1], input + last_offset);
+}
+
+// Same as decode_huffman() for any alphabet. Tables for more than 256 symbols
+// (the ones with cutoff_lut) use the extension tables for the high bits.
+size_t decode_huffman_symbols(const struct table_root_t* table, const unsigned char* input, size_t length,
+    unsigned short* output, size_t n_symbols) {
+    bit_reader_t reader;
+    init_bit_reader(&reader, input, length);
+    if (!table->cutoff_lut) {
+        for (size_t i = 0; i < n_symbols; i++)
+            output[i] = table->canonical_decode_lut[decode_canon(table, &reader, false)];
+    } else {
+        for (size_t i = 0; i < n_symbols; i++) {
+            unsigned canon = decode_canon(table, &reader, true);
+            output[i] = table->canonical_decode_lut[canon]
+                | read_ext_bits(table->canonical_decode_ext_lut, canon) << 8;
+        }
     }
-    *align_pos = bit_buffer;
-    // Run table generation
-    if (table && n_table)
-        *n_table = generate_table(table, freq, 256);
-    return align_pos + 1 - output;
+    return bytes_read(&reader, input);
 }
@@ -1,8 +1,55 @@
 #ifndef SOFTWARE_MODEL_H_
 #define SOFTWARE_MODEL_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*bit_sink_t)(void* context, const unsigned char* data, size_t length);
+
+// Forward streaming Huffman bit writer. Codes are emitted in symbol order straight into
+// the buffer, so data can be encoded in pieces with any number of bit_writer_write() calls
+// and a final bit_writer_flush().
+struct bit_writer_t {
+    const struct huffman_code_t* codes;
+    uint64_t acc; // Bits not written yet, right aligned
+    int n_bits; // Number of valid bits in acc
+    unsigned char* begin;
+    unsigned char* pos;
+    unsigned char* end;
+    bit_sink_t sink; // Where full buffers go. NULL if the buffer is the destination.
+    void* context;
+    size_t n_drained; // Bytes handed to the sink so far
+    bool overflow; // The destination (without a sink) filled up
+};
+
+// Interleaved format: the symbols are split into INTERLEAVED_STREAMS runs of ceil(n / 4)
+// (the last one gets the rest), each coded as its own bitstream. The streams follow a jump
+// table holding the byte sizes of all but the last one (u32, little endian).
+#define INTERLEAVED_STREAMS 4
+#define INTERLEAVED_JUMP_TABLE_SIZE (4 * (INTERLEAVED_STREAMS - 1))
+
 void output_bitstream(unsigned char** pos, short* bit_pos, unsigned char* buf, bool bit);
+void bit_writer_init(bit_writer_t* writer, const struct huffman_code_t* codes, unsigned char* buffer, size_t size,
+    bit_sink_t sink = NULL, void* context = NULL);
+void bit_writer_write(bit_writer_t* writer, const unsigned char* data, size_t length);
+void bit_writer_write_symbols(bit_writer_t* writer, const unsigned short* symbols, size_t length);
+size_t bit_writer_flush(bit_writer_t* writer);
+void file_bit_sink(void* file, const unsigned char* data, size_t length);
+size_t encode_huffman(const struct huffman_code_t* codes, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit);
+size_t encode_huffman_tables(const struct table_root_t* table, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit);
+size_t encode_huffman_interleaved(const struct huffman_code_t* codes, const unsigned char* data, size_t length,
+    unsigned char* output, size_t limit);
 size_t generate_huffman_ref(const unsigned char* data, size_t length, unsigned char* output, size_t limit, struct table_root_t* table = NULL, 
     size_t* n_table = NULL);
+size_t decode_huffman(const struct table_root_t* table, const unsigned char* input, size_t length,
+    unsigned char* output, size_t n_symbols);
+size_t decode_huffman_fast(const struct table_root_t* table, const struct fast_decode_table_t* fast,
+    const unsigned char* input, size_t length, unsigned char* output, size_t n_symbols);
+size_t decode_huffman_interleaved(const struct table_root_t* table, const struct fast_decode_table_t* fast,
+    const unsigned char* input, size_t length, unsigned char* output, size_t n_symbols);
+size_t decode_huffman_symbols(const struct table_root_t* table, const unsigned char* input, size_t length,
+    unsigned short* output, size_t n_symbols);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,283 @@
+#ifndef STATIC_TABLE_H_
+#define STATIC_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "table_gen.h"
+
+// Tables for fixed codes, built at compile time. A stream with a well-known code (e.g. the
+// static text model below) doesn't need a histogram, a tree or table generation per block:
+//
+//     inline constexpr static_table_t my_table = make_static_table(my_spec);
+//     static_assert(my_table.valid, "my_spec is not a complete code that fits the tables");
+//     encode_static<my_table>(data, length, output, limit);
+//
+// The spec is a code length for each byte (a canonical code is assigned to them) or byte
+// frequencies (a Huffman code is built first, with zero frequencies counted as 1 so every
+// byte keeps a code). The result has the same table image the hardware reads, so
+// map_table_image(&table, my_table.image) works with every runtime path as well.
+//
+// Canonical symbols are ranks in (code length, byte) order, which is left to right in the
+// code tree, as the max_lut comparisons need. The tables are numbered breadth first.
+// encode_static() / decode_static() are instantiated for one table, so the code and
+// decode lookups go straight to constant data and can be inlined.
+
+// The specialized encoder writes at most 32 bits per code
+#define STATIC_CODE_MAX_LENGTH 32
+
+struct static_code_lengths_t {
+    unsigned char length[256];
+};
+
+struct static_frequencies_t {
+    unsigned freq[256];
+};
+
+struct static_table_t {
+    bool valid; // The spec is a complete code of at most STATIC_CODE_MAX_LENGTH bits in at most HUFFMAN_MAX_TABLES tables
+    unsigned char image[TABLE_IMAGE_SIZE]; // Same layout as data/table.dat
+    size_t n_table;
+    int max_length;
+    huffman_code_t codes[256];
+    fast_decode_table_t fast;
+    // Canonical decoding of the codes the fast table doesn't cover: codes of length l are
+    // first_code[l] to first_code[l] + count[l] - 1, for canonical symbols offset[l] onwards
+    uint64_t first_code[STATIC_CODE_MAX_LENGTH + 1];
+    unsigned count[STATIC_CODE_MAX_LENGTH + 1];
+    unsigned offset[STATIC_CODE_MAX_LENGTH + 1];
+};
+
+constexpr static_table_t make_static_table(const static_code_lengths_t& spec) {
+    static_table_t t{};
+    unsigned char* next_table = t.image;
+    unsigned char* upper_max_lut = t.image + 16 * HUFFMAN_MAX_TABLES;
+    unsigned char* lower_max_lut = upper_max_lut + 8 * HUFFMAN_MAX_TABLES;
+    unsigned char* canonical_lut = lower_max_lut + 8 * HUFFMAN_MAX_TABLES;
+    unsigned char* canonical_decode_lut = canonical_lut + 256;
+
+    // The code has to be complete: the Kraft sum is exactly 1
+    uint64_t kraft = 0;
+    for (int s = 0; s < 256; s++) {
+        int length = spec.length[s];
+        if (length < 1 || length > STATIC_CODE_MAX_LENGTH) return t;
+        kraft += (uint64_t) 1 << (STATIC_CODE_MAX_LENGTH - length);
+        if (length > t.max_length) t.max_length = length;
+    }
+    if (kraft != (uint64_t) 1 << STATIC_CODE_MAX_LENGTH) return t;
+
+    // Canonical symbols and codes
+    unsigned rank = 0;
+    uint64_t code = 0;
+    for (int l = 1; l <= t.max_length; l++) {
+        t.first_code[l] = code;
+        t.offset[l] = rank;
+        for (int s = 0; s < 256; s++) {
+            if (spec.length[s] != l) continue;
+            canonical_lut[s] = rank;
+            canonical_decode_lut[rank] = s;
+            t.codes[s].code = code + (rank - t.offset[l]);
+            t.codes[s].length = l;
+            rank++;
+        }
+        t.count[l] = rank - t.offset[l];
+        code = (code + t.count[l]) << 1;
+    }
+
+    // Every table covers the codes under a 4k-bit prefix. An entry is a leaf if a code of at
+    // most 4 more bits matches it; otherwise it gets a new table, and the last (largest)
+    // canonical symbol under it.
+    uint64_t prefix[HUFFMAN_MAX_TABLES] = {};
+    int depth[HUFFMAN_MAX_TABLES] = {};
+    t.n_table = 1;
+    for (size_t table = 0; table < t.n_table; table++) {
+        for (int entry = 0; entry < 16; entry++) {
+            uint64_t entry_prefix = prefix[table] << 4 | entry;
+            int entry_depth = depth[table] + 4;
+            int leaf = -1, max_symbol = -1;
+            for (int s = 0; s < 256; s++) {
+                int length = t.codes[s].length;
+                if (length <= depth[table]) continue;
+                if (length <= entry_depth) {
+                    if (entry_prefix >> (entry_depth - length) == t.codes[s].code) leaf = canonical_lut[s];
+                } else if (t.codes[s].code >> (length - entry_depth) == entry_prefix && canonical_lut[s] > max_symbol) {
+                    max_symbol = canonical_lut[s];
+                }
+            }
+            if (leaf < 0) {
+                if (t.n_table == HUFFMAN_MAX_TABLES) return t;
+                prefix[t.n_table] = entry_prefix;
+                depth[t.n_table] = entry_depth;
+                next_table[table * 16 + entry] = t.n_table++;
+            }
+            unsigned char* max_lut = entry & 8 ? upper_max_lut : lower_max_lut;
+            max_lut[table * 8 + (entry & 7)] = leaf < 0 ? max_symbol : leaf;
+        }
+    }
+    generate_fast_decode_table(t.codes, &t.fast);
+    t.valid = true;
+    return t;
+}
+
+// Huffman code lengths for the frequencies, with ties going to the lower symbol or node
+constexpr static_code_lengths_t static_code_lengths(const static_frequencies_t& spec) {
+    uint64_t weight[511] = {};
+    int parent[511] = {};
+    bool active[511] = {};
+    for (int s = 0; s < 256; s++) {
+        weight[s] = spec.freq[s] ? spec.freq[s] : 1;
+        active[s] = true;
+    }
+    for (int node = 256; node < 511; node++) {
+        int a = -1, b = -1;
+        for (int i = 0; i < node; i++) {
+            if (!active[i]) continue;
+            if (a < 0 || weight[i] < weight[a]) {
+                b = a;
+                a = i;
+            } else if (b < 0 || weight[i] < weight[b]) {
+                b = i;
+            }
+        }
+        active[a] = active[b] = false;
+        weight[node] = weight[a] + weight[b];
+        parent[a] = parent[b] = node;
+        active[node] = true;
+    }
+    static_code_lengths_t lengths{};
+    for (int s = 0; s < 256; s++) {
+        int length = 0;
+        for (int i = s; i != 510; i = parent[i]) length++;
+        lengths.length[s] = length;
+    }
+    return lengths;
+}
+
+constexpr static_table_t make_static_table(const static_frequencies_t& spec) {
+    return make_static_table(static_code_lengths(spec));
+}
+
+// A static model for English text: letters by their usual frequency (in tenths of a
+// percent), lots of spaces, some punctuation and digits. The other bytes are rare, but not
+// so rare that their codes go past 12 bits, which keeps the model at 33 tables.
+constexpr static_frequencies_t static_text_frequencies() {
+    const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+    const unsigned letter_freq[26] = {127, 91, 82, 75, 70, 67, 63, 61, 60, 43, 40, 28, 28, 24, 24, 22, 20, 20, 19, 15,
+        10, 8, 2, 2, 1, 1};
+    static_frequencies_t spec{};
+    for (int s = 0; s < 256; s++) spec.freq[s] = s >= ' ' && s < 127 ? 8 : 4;
+    for (int i = 0; i < 26; i++) {
+        spec.freq[(unsigned char) letters[i]] = 16 * letter_freq[i];
+        spec.freq[(unsigned char) letters[i] - 'a' + 'A'] = letter_freq[i] + 4;
+    }
+    spec.freq[' '] = 3000;
+    spec.freq['\n'] = 300;
+    spec.freq[','] = spec.freq['.'] = 200;
+    for (int d = '0'; d <= '9'; d++) spec.freq[d] = 40;
+    return spec;
+}
+
+inline constexpr static_table_t static_text_table = make_static_table(static_text_frequencies());
+static_assert(static_text_table.valid, "the static text model doesn't fit the tables");
+
+// Same output as encode_huffman() with table.codes.
+// Return the number of bytes written. The last byte is padded with 0.
+template <const static_table_t& table>
+size_t encode_static(const unsigned char* data, size_t length, unsigned char* output, size_t limit) {
+    static_assert(table.valid, "encode_static needs a valid static table");
+    unsigned char* pos = output;
+    unsigned char* end = output + limit;
+    uint64_t acc = 0;
+    int n_bits = 0; // Bits in acc not written yet, always < 32 between symbols
+    for (size_t i = 0; i < length; i++) {
+        const huffman_code_t& code = table.codes[data[i]];
+        acc = acc << code.length | code.code;
+        n_bits += code.length;
+        if (n_bits < 32) continue;
+        n_bits -= 32;
+        if (end - pos < 4) {
+            for (int shamt = n_bits + 24; pos < end; shamt -= 8) *pos++ = acc >> shamt;
+            fprintf(stderr, "Huffman limit hit");
+            return limit;
+        }
+        uint32_t word = __builtin_bswap32(acc >> n_bits);
+        memcpy(pos, &word, 4);
+        pos += 4;
+    }
+    for (acc <<= 8; n_bits > 0; n_bits -= 8) {
+        if (pos == end) {
+            fprintf(stderr, "Huffman limit hit");
+            return limit;
+        }
+        *pos++ = acc >> n_bits;
+    }
+    return pos - output;
+}
+
+// Decode n_symbols symbols of a stream written with the static table: up to
+// FAST_DECODE_MAX_SYMBOLS at a time from its single-lookup table, and the longer codes
+// with the canonical code ranges.
+// Return the number of input bytes consumed, counting the missing bits of a truncated
+// stream as 0 like decode_huffman().
+template <const static_table_t& table>
+size_t decode_static(const unsigned char* input, size_t length, unsigned char* output, size_t n_symbols) {
+    static_assert(table.valid, "decode_static needs a valid static table");
+    const unsigned char* canonical_decode_lut = table.image + 32 * HUFFMAN_MAX_TABLES + 256;
+    const unsigned char* pos = input;
+    const unsigned char* end = input + length;
+    uint64_t buf = 0; // Valid bits are left aligned
+    int count = 0;
+    size_t n_padding = 0;
+    // Top up to at least 56 bits, 8 bytes at a time in the middle of the stream
+    auto refill = [&] {
+        if (count >= STATIC_CODE_MAX_LENGTH) return;
+        if (end - pos >= 8) {
+            uint64_t word;
+            memcpy(&word, pos, 8);
+            buf |= __builtin_bswap64(word) >> count;
+            pos += (63 - count) >> 3;
+            count |= 56;
+            return;
+        }
+        for (; count <= 56; count += 8) {
+            uint64_t byte = 0;
+            if (pos < end) byte = *pos++;
+            else n_padding++;
+            buf |= byte << (56 - count);
+        }
+    };
+    // One symbol whose code is at least min_length bits long
+    auto decode_canonical = [&](int min_length) {
+        int l = min_length;
+        while (l < table.max_length && (buf >> (64 - l)) - table.first_code[l] >= table.count[l]) l++;
+        unsigned char symbol = canonical_decode_lut[table.offset[l] + (buf >> (64 - l)) - table.first_code[l]];
+        buf <<= l;
+        count -= l;
+        return symbol;
+    };
+
+    size_t i = 0;
+    // Every entry writes all its symbol slots, so stop while there is room for them
+    while (i + FAST_DECODE_MAX_SYMBOLS <= n_symbols) {
+        refill();
+        const fast_decode_entry_t& entry = table.fast.entries[buf >> (64 - FAST_DECODE_BITS)];
+        if (!entry.n_symbols) {
+            output[i++] = decode_canonical(FAST_DECODE_BITS + 1);
+            continue;
+        }
+        memcpy(output + i, entry.symbols, FAST_DECODE_MAX_SYMBOLS);
+        i += entry.n_symbols;
+        buf <<= entry.n_bits;
+        count -= entry.n_bits;
+    }
+    for (; i < n_symbols; i++) {
+        refill();
+        output[i] = decode_canonical(1);
+    }
+    size_t n_bits = (pos - input + n_padding) * 8 - count;
+    return (n_bits + 7) / 8;
+}
+
+#endif
@@ -0,0 +1,34 @@
+#include "table_batch.h"
+
+table_batch_t::table_batch_t(table_batch_t&& other) : buffer(std::move(other.buffer)), capacity(other.capacity),
+    n_images(other.n_images) {
+    other.capacity = 0;
+    other.n_images = 0;
+}
+
+table_batch_t& table_batch_t::operator=(table_batch_t&& other) {
+    if (this == &other) return *this;
+    buffer = std::move(other.buffer);
+    capacity = other.capacity;
+    n_images = other.n_images;
+    other.capacity = 0;
+    other.n_images = 0;
+    return *this;
+}
+
+void table_batch_t::generate(const unsigned* freq, size_t n, huffman_code_t* codes, short max_length,
+    int max_tables) {
+    if (n > capacity) {
+        buffer.reset(new unsigned char[n * (TABLE_IMAGE_SIZE + 1)]);
+        capacity = n;
+    }
+    n_images = n;
+    unsigned char* counts = buffer.get() + capacity * TABLE_IMAGE_SIZE;
+    // One arena for the whole batch; every tree is done with before the next one is built
+    huffman_arena_t arena;
+    for (size_t i = 0; i < n; i++) {
+        huffman_t* root = build_limited_huffman_tree(&freq[i * 256], 256, max_length, max_tables, &arena);
+        if (codes) generate_code_table(root, &codes[i * 256]);
+        counts[i] = generate_table_image(root, buffer.get() + i * TABLE_IMAGE_SIZE);
+    }
+}
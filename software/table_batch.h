@@ -0,0 +1,39 @@
+#ifndef TABLE_BATCH_H_
+#define TABLE_BATCH_H_
+
+#include <stddef.h>
+#include <memory>
+
+#include "table_gen.h"
+
+// Table images for a batch of byte alphabet histograms, all in one buffer. generate()
+// reuses the buffer when it's big enough, so a batch kept across calls only allocates when
+// it grows. The buffer is freed with the batch; moving a batch moves the buffer.
+class table_batch_t {
+public:
+    table_batch_t() : capacity(0), n_images(0) {}
+    table_batch_t(table_batch_t&& other);
+    table_batch_t& operator=(table_batch_t&& other);
+    table_batch_t(const table_batch_t&) = delete;
+    table_batch_t& operator=(const table_batch_t&) = delete;
+
+    // Build the tables for n histograms of 256 symbols (freq holds 256 per image).
+    // If codes is given, it gets the 256 codes of every image as well.
+    void generate(const unsigned* freq, size_t n, huffman_code_t* codes = NULL,
+        short max_length = HUFFMAN_MAX_CODE_LENGTH, int max_tables = HUFFMAN_MAX_TABLES);
+    size_t size() const { return n_images; }
+    // TABLE_IMAGE_SIZE bytes laid out like write_table_image()
+    const unsigned char* image(size_t i) const { return buffer.get() + i * TABLE_IMAGE_SIZE; }
+    // Tables used by image i
+    size_t n_table(size_t i) const { return buffer[capacity * TABLE_IMAGE_SIZE + i]; }
+    // Point table into image i, see map_table_image()
+    void map(size_t i, struct table_root_t* table) const { map_table_image(table, image(i)); }
+
+private:
+    // capacity images, then the table count of each one (at most HUFFMAN_MAX_TABLES, so a byte)
+    std::unique_ptr<unsigned char[]> buffer;
+    size_t capacity;
+    size_t n_images;
+};
+
+#endif
@@ -0,0 +1,65 @@
+#include <string.h>
+
+#include "table_gen.h"
+#include "histogram.h"
+#include "table_cache.h"
+
+void table_cache_init(table_cache_t* cache, double max_penalty) {
+    cache->n_entries = 0;
+    cache->max_penalty = max_penalty;
+    cache->tick = 0;
+    cache->n_generated = 0;
+    cache->n_reused = 0;
+}
+
+// Encoded size in bits of a block with this histogram under this code
+uint64_t code_cost_bits(const huffman_code_t* codes, const unsigned* freq) {
+    uint64_t bits = 0;
+    for (int s = 0; s < 256; s++) bits += (uint64_t) freq[s] * codes[s].length;
+    return bits;
+}
+
+// Find the cached table that encodes freq in the fewest bits and use it if the penalty over
+// the entropy is small enough. (A fresh Huffman code is never below the entropy and less
+// than one bit per symbol above it, so it stands in for the size a new table would give.)
+// Otherwise build a new table in place of the least recently used one. The entry stays
+// valid until the next call.
+const table_cache_entry_t* table_cache_get(table_cache_t* cache, const unsigned* freq, bool* reused) {
+    cache->tick++;
+    table_cache_entry_t* best = NULL;
+    uint64_t best_cost = 0;
+    for (int i = 0; i < cache->n_entries; i++) {
+        uint64_t cost = code_cost_bits(cache->entries[i].codes, freq);
+        if (!best || cost < best_cost) {
+            best = &cache->entries[i];
+            best_cost = cost;
+        }
+    }
+    if (best && cache->max_penalty >= 0) {
+        double entropy = entropy_bits(freq);
+        if (best_cost - entropy <= cache->max_penalty * entropy) {
+            best->last_use = cache->tick;
+            cache->n_reused++;
+            if (reused) *reused = true;
+            return best;
+        }
+    }
+
+    // Build a new table over the least recently used entry
+    table_cache_entry_t* entry;
+    if (cache->n_entries < TABLE_CACHE_ENTRIES) {
+        entry = &cache->entries[cache->n_entries++];
+    } else {
+        entry = &cache->entries[0];
+        for (int i = 1; i < TABLE_CACHE_ENTRIES; i++)
+            if (cache->entries[i].last_use < entry->last_use) entry = &cache->entries[i];
+    }
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    generate_code_table(root, entry->codes);
+    entry->n_table = generate_table_image(root, entry->image);
+    entry->id = cache->n_generated++;
+    entry->last_use = cache->tick;
+    if (reused) *reused = false;
+    return entry;
+}
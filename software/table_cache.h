@@ -0,0 +1,41 @@
+#ifndef TABLE_CACHE_H_
+#define TABLE_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "table_gen.h"
+
+// Cache of recently generated tables. Blocks from the same source tend to have nearly the
+// same histogram; for those, encoding with a table we already have costs a few more bits
+// but skips the tree and table generation, and on the accelerator the table SRAM reload.
+//
+// Every table covers all 256 symbols (zero-frequency symbols get the longest codes), so any
+// cached table can encode any block. The question is only how many bits it wastes.
+
+#define TABLE_CACHE_ENTRIES 8
+
+struct table_cache_entry_t {
+    unsigned char image[TABLE_IMAGE_SIZE]; // Same layout as data/table.dat, see map_table_image()
+    huffman_code_t codes[256];
+    size_t n_table;
+    uint64_t id; // Tables generated by the cache before this one
+    uint64_t last_use;
+};
+
+struct table_cache_t {
+    table_cache_entry_t entries[TABLE_CACHE_ENTRIES];
+    int n_entries;
+    // A cached table is used if it makes the block at most this much bigger,
+    // as a fraction of the entropy of the block. Below 0 nothing is reused.
+    double max_penalty;
+    uint64_t tick;
+    uint64_t n_generated;
+    uint64_t n_reused;
+};
+
+void table_cache_init(table_cache_t* cache, double max_penalty);
+const table_cache_entry_t* table_cache_get(table_cache_t* cache, const unsigned* freq, bool* reused = NULL);
+uint64_t code_cost_bits(const huffman_code_t* codes, const unsigned* freq);
+
+#endif
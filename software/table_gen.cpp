@@ -1,4 +1,4 @@
-#include <queue>
+#include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,37 +6,53 @@
 #include "table_gen.h"
 
 // Build the huffman tree in the normal binary tree format.
-huffman_t* build_huffman_tree(const unsigned* freq, short nsymbols
+// All nodes are taken from the arena: the leaves first, in increasing weight order, and then
+// the internal nodes in the order they are created. Since every new internal node is at
+// least as heavy as the previous one, the internal nodes already form a sorted queue, so
+// after sorting the leaves the merge is linear (the classic two-queue construction).
+huffman_t* build_huffman_tree(const unsigned* freq, short nsymbols, huffman_arena_t* arena
 #ifdef STIMULUS_GENERATE
     , huffman_t** encode_table
 #endif
 ) {
-    // build Huffman Tree
-    auto cmp = [](huffman_t* left, huffman_t* right) { return left->weight > right->weight; };
-    std::priority_queue<huffman_t*, std::deque<huffman_t*>, decltype(cmp)> queue(cmp, std::deque<huffman_t*>());
-    // Initialize heap with the size
+    if (nsymbols > HUFFMAN_MAX_SYMBOLS) {
+        fprintf(stderr, "build_huffman_tree doesn't support nsymbols > %d\n", HUFFMAN_MAX_SYMBOLS);
+        exit(-1);
+    }
+    huffman_t* nodes = arena->nodes;
+    // Sort the symbols by weight, then by symbol
+    uint64_t keys[HUFFMAN_MAX_SYMBOLS];
+    for (int i = 0; i < nsymbols; i++) keys[i] = (uint64_t) freq[i] << 16 | i;
+    std::sort(keys, keys + nsymbols);
+    // Initialize the leaf queue
     for (int i = 0; i < nsymbols; i++) {
-        huffman_t* node = new huffman_t;
-        node->symbol = i;
+        huffman_t* node = &nodes[i];
+        node->symbol = keys[i] & 0xffff;
         node->height = 1;
         node->num_symbol = 1;
-        node->weight = freq[i];
+        node->weight = freq[node->symbol];
         node->left = nullptr;
         node->right = nullptr;
 #ifdef STIMULUS_GENERATE
         node->parent = nullptr;
-        if (encode_table) encode_table[i] = node;
+        if (encode_table) encode_table[node->symbol] = node;
 #endif
-        queue.push(node);
     }
+    // Take the lighter head of the two queues. On a tie take the leaf, which keeps the tree shallow.
+    int next_leaf = 0;
+    int next_internal = nsymbols;
+    int n_nodes = nsymbols;
+    auto pop = [&]() {
+        if (next_leaf < nsymbols && (next_internal == n_nodes || nodes[next_leaf].weight <= nodes[next_internal].weight))
+            return &nodes[next_leaf++];
+        return &nodes[next_internal++];
+    };
     // Merge nodes
-    while (queue.size() != 1) {
-        huffman_t* node = new huffman_t;
+    while (n_nodes < 2 * nsymbols - 1) {
+        huffman_t* subnode_a = pop();
+        huffman_t* subnode_b = pop();
+        huffman_t* node = &nodes[n_nodes++];
         node->symbol = 0;
-        huffman_t* subnode_a = queue.top();
-        queue.pop();
-        huffman_t* subnode_b = queue.top();
-        queue.pop();
 
         // Determine the order: higher tree to the right, otherwise, smaller symbol value to the left
         // Required for canonical
@@ -59,9 +75,251 @@ huffman_t* build_huffman_tree(const unsigned* freq, short nsymbols
         node->left->parent = node;
         node->right->parent = node;
 #endif
-        queue.push(node);
     }
-    return queue.top();
+    return &nodes[n_nodes - 1];
+}
+
+// Walk the tree and collect the statistics the length limit cares about.
+static void measure_tree(const huffman_t* node, short depth, uint64_t* bits, short* max_depth, int* n_table) {
+    if (!node->left && !node->right) {
+        *bits += (uint64_t) node->weight * (depth ? depth : 1);
+        if (depth > *max_depth) *max_depth = depth;
+        return;
+    }
+    // Internal nodes at the last level of a 4-bit group start a new table
+    if (depth && depth % 4 == 0) (*n_table)++;
+    measure_tree(node->left, depth + 1, bits, max_depth, n_table);
+    measure_tree(node->right, depth + 1, bits, max_depth, n_table);
+}
+
+// Number of tables a canonical code with these lengths needs. Canonical codes put
+// the short codes on the left, so at depth d every slot not taken by a code of
+// length <= d is an internal node, and each internal node at depth 4k starts a table.
+static int count_tables(const short* lengths, short nsymbols, short max_length) {
+    int n_table = 1;
+    for (short depth = 4; depth < max_length; depth += 4) {
+        uint64_t used = 0;
+        for (short i = 0; i < nsymbols; i++)
+            if (lengths[i] <= depth) used += (uint64_t) 1 << (depth - lengths[i]);
+        uint64_t n_internal = ((uint64_t) 1 << depth) - used;
+        if (n_internal > (uint64_t) HUFFMAN_MAX_TABLES) return HUFFMAN_MAX_TABLES + 1;
+        n_table += n_internal;
+    }
+    return n_table;
+}
+
+// Package-merge (Larmore and Hirschberg): optimal code lengths with no code longer
+// than max_length. Level j holds the items (leaves or packages of two items of level j + 1)
+// that can take a bit at depth j + 1; the first 2n - 2 items of level 0 are picked and
+// unpacked back down. Requires 2 ^ max_length >= nsymbols.
+static void package_merge(const unsigned* freq, short nsymbols, short max_length, short* lengths) {
+    const int n_items = 2 * nsymbols - 2;
+    uint64_t keys[HUFFMAN_MAX_SYMBOLS];
+    for (int i = 0; i < nsymbols; i++) keys[i] = (uint64_t) freq[i] << 16 | i;
+    std::sort(keys, keys + nsymbols);
+
+    static_assert(HUFFMAN_MAX_CODE_LENGTH <= 64, "package_merge keeps one level per code bit");
+    unsigned char is_package[HUFFMAN_MAX_CODE_LENGTH][2 * HUFFMAN_MAX_SYMBOLS];
+    int list_length[HUFFMAN_MAX_CODE_LENGTH];
+    uint64_t weights[2][2 * HUFFMAN_MAX_SYMBOLS];
+    // The deepest level only has leaves
+    int level = max_length - 1;
+    list_length[level] = nsymbols;
+    for (int i = 0; i < nsymbols; i++) {
+        weights[level & 1][i] = keys[i] >> 16;
+        is_package[level][i] = 0;
+    }
+    // Every other level merges the leaves with the packages of the level below.
+    // On a tie the leaf goes first. Items after the first 2n - 2 are never picked.
+    for (level--; level >= 0; level--) {
+        const uint64_t* below = weights[(level + 1) & 1];
+        uint64_t* current = weights[level & 1];
+        int n_packages = list_length[level + 1] / 2;
+        int leaf = 0, package = 0, n = 0;
+        while (n < n_items && (leaf < nsymbols || package < n_packages)) {
+            uint64_t package_weight = package < n_packages ? below[2 * package] + below[2 * package + 1] : 0;
+            if (leaf < nsymbols && (package == n_packages || (keys[leaf] >> 16) <= package_weight)) {
+                current[n] = keys[leaf++] >> 16;
+                is_package[level][n++] = 0;
+            } else {
+                current[n] = package_weight;
+                is_package[level][n++] = 1;
+                package++;
+            }
+        }
+        list_length[level] = n;
+    }
+    // Unpack. Leaves within a level are in sorted order, so picking the first k items
+    // of a level gives one more bit to the first (k - packages) symbols.
+    for (int i = 0; i < nsymbols; i++) lengths[i] = 0;
+    int n_picked = n_items;
+    for (level = 0; level < max_length && n_picked; level++) {
+        int n_leaves = 0;
+        for (int i = 0; i < n_picked; i++) n_leaves += !is_package[level][i];
+        for (int i = 0; i < n_leaves; i++) lengths[keys[i] & 0xffff]++;
+        n_picked = 2 * (n_picked - n_leaves);
+    }
+}
+
+// Build the canonical tree for a set of code lengths: at every depth the leaves come
+// first (in symbol order), then the internal nodes. This keeps the rule in build_huffman_tree()
+// that the higher subtree is always on the right.
+static huffman_t* build_tree_from_lengths(const unsigned* freq, const short* lengths, short nsymbols, short max_length,
+    huffman_arena_t* arena) {
+    huffman_t* nodes = arena->nodes;
+    int n_nodes = 0;
+    huffman_t* level_nodes[2][2 * HUFFMAN_MAX_SYMBOLS];
+    int n_below = 0;
+    for (short depth = max_length; depth >= 0; depth--) {
+        huffman_t** current = level_nodes[depth & 1];
+        huffman_t** below = level_nodes[(depth + 1) & 1];
+        int n = 0;
+        for (short i = 0; i < nsymbols; i++) {
+            if (lengths[i] != depth) continue;
+            huffman_t* node = &nodes[n_nodes++];
+            node->symbol = i;
+            node->height = 1;
+            node->num_symbol = 1;
+            node->weight = freq[i];
+            node->left = nullptr;
+            node->right = nullptr;
+#ifdef STIMULUS_GENERATE
+            node->parent = nullptr;
+#endif
+            current[n++] = node;
+        }
+        for (int i = 0; i + 1 < n_below; i += 2) {
+            huffman_t* node = &nodes[n_nodes++];
+            node->symbol = 0;
+            node->left = below[i];
+            node->right = below[i + 1];
+            node->height = 1 + (node->left->height > node->right->height ? node->left->height : node->right->height);
+            node->num_symbol = node->right->num_symbol + node->left->num_symbol;
+            node->weight = node->right->weight + node->left->weight;
+#ifdef STIMULUS_GENERATE
+            node->parent = NULL;
+            node->left->parent = node;
+            node->right->parent = node;
+#endif
+            current[n++] = node;
+        }
+        n_below = n;
+    }
+    return level_nodes[0][0];
+}
+
+// Code lengths for alphabets over 256 symbols when shortening the code doesn't help:
+// a code with more than 256 symbols has codes longer than 8 bits, and every internal node
+// at depth 8 is a table. Here the rarest symbols are bundled 16 at a time into groups that
+// are placed like one symbol in an 8-bit limited code over the common symbols, so a group
+// at depth 8 fills exactly one table. Every number of groups is tried and the cheapest
+// code that fits is kept. Return the number of tables, or max_tables + 1 if nothing fits.
+static int bundle_rare_symbols(const unsigned* freq, short nsymbols, short max_length, int max_tables,
+    short* lengths) {
+    uint64_t keys[HUFFMAN_MAX_SYMBOLS];
+    for (int i = 0; i < nsymbols; i++) keys[i] = (uint64_t) freq[i] << 16 | i;
+    std::sort(keys, keys + nsymbols);
+
+    int best_tables = max_tables + 1;
+    uint64_t best_bits = 0;
+    for (int n_groups = (nsymbols - 256 + 14) / 15; 16 * n_groups < nsymbols; n_groups++) {
+        // The first n_rare keys are the rarest symbols, the rest stay in the 8-bit code
+        int n_rare = 16 * n_groups;
+        int n_top = nsymbols - n_rare + n_groups;
+        unsigned top_freq[256];
+        short top_lengths[256];
+        for (int i = n_rare; i < nsymbols; i++) top_freq[i - n_rare] = keys[i] >> 16;
+        for (int g = 0; g < n_groups; g++) {
+            top_freq[nsymbols - n_rare + g] = 0;
+            for (int i = 16 * g; i < 16 * g + 16; i++) top_freq[nsymbols - n_rare + g] += keys[i] >> 16;
+        }
+        package_merge(top_freq, n_top, 8, top_lengths);
+
+        short candidate[HUFFMAN_MAX_SYMBOLS];
+        for (int i = n_rare; i < nsymbols; i++) candidate[keys[i] & 0xffff] = top_lengths[i - n_rare];
+        for (int g = 0; g < n_groups; g++) {
+            unsigned group_freq[16];
+            short group_lengths[16];
+            for (int i = 0; i < 16; i++) group_freq[i] = keys[16 * g + i] >> 16;
+            package_merge(group_freq, 16, 4, group_lengths);
+            for (int i = 0; i < 16; i++)
+                candidate[keys[16 * g + i] & 0xffff] = top_lengths[nsymbols - n_rare + g] + group_lengths[i];
+        }
+
+        short candidate_length = 0;
+        uint64_t bits = 0;
+        for (int i = 0; i < nsymbols; i++) {
+            if (candidate[i] > candidate_length) candidate_length = candidate[i];
+            bits += (uint64_t) freq[i] * candidate[i];
+        }
+        if (candidate_length > max_length) continue;
+        int n_table = count_tables(candidate, nsymbols, candidate_length);
+        if (n_table <= max_tables && (best_tables > max_tables || bits < best_bits)) {
+            best_tables = n_table;
+            best_bits = bits;
+            memcpy(lengths, candidate, nsymbols * sizeof(short));
+        }
+    }
+    return best_tables;
+}
+
+// Build a Huffman tree whose codes are at most max_length bits and whose tables fit in
+// max_tables tables. The plain Huffman tree is used whenever it already fits, which is
+// almost always the case. Otherwise the code is rebuilt with package-merge, trying the
+// longest limit first and tightening it until the tables fit.
+huffman_t* build_limited_huffman_tree(const unsigned* freq, short nsymbols, short max_length, int max_tables,
+    huffman_arena_t* arena, length_limit_report_t* report) {
+    if (max_length > HUFFMAN_MAX_CODE_LENGTH) max_length = HUFFMAN_MAX_CODE_LENGTH;
+    if (max_tables > HUFFMAN_MAX_TABLES) max_tables = HUFFMAN_MAX_TABLES;
+    huffman_t* root = build_huffman_tree(freq, nsymbols, arena);
+    uint64_t huffman_bits = 0;
+    short huffman_length = 0;
+    int huffman_tables = 1;
+    measure_tree(root, 0, &huffman_bits, &huffman_length, &huffman_tables);
+    if (report) {
+        report->limited = false;
+        report->max_length = huffman_length;
+        report->n_table = huffman_tables;
+        report->huffman_bits = huffman_bits;
+        report->limited_bits = huffman_bits;
+    }
+    if (huffman_length <= max_length && huffman_tables <= max_tables) return root;
+
+    // Find the longest limit that fits the table budget
+    short min_length = 1;
+    while ((1 << min_length) < nsymbols) min_length++;
+    short lengths[HUFFMAN_MAX_SYMBOLS];
+    short limit = huffman_length < max_length ? huffman_length : max_length;
+    int n_table = 0;
+    for (; limit >= min_length; limit--) {
+        package_merge(freq, nsymbols, limit, lengths);
+        n_table = count_tables(lengths, nsymbols, limit);
+        if (n_table <= max_tables) break;
+    }
+    if (limit < min_length && nsymbols > 256) {
+        n_table = bundle_rare_symbols(freq, nsymbols, max_length, max_tables, lengths);
+        if (n_table <= max_tables) {
+            limit = 0;
+            for (short i = 0; i < nsymbols; i++)
+                if (lengths[i] > limit) limit = lengths[i];
+        }
+    }
+    if (limit < min_length) {
+        fprintf(stderr, "build_limited_huffman_tree can't fit %d symbols in %d tables\n", nsymbols, max_tables);
+        exit(-1);
+    }
+    root = build_tree_from_lengths(freq, lengths, nsymbols, limit, arena);
+    if (report) {
+        report->limited = true;
+        report->max_length = 0;
+        report->limited_bits = 0;
+        for (short i = 0; i < nsymbols; i++) {
+            if (lengths[i] > report->max_length) report->max_length = lengths[i];
+            report->limited_bits += (uint64_t) freq[i] * lengths[i];
+        }
+        report->n_table = n_table;
+    }
+    return root;
 }
 
 // Since there are too many recursive arguments, I made a structure to hold them
@@ -79,28 +337,53 @@ struct global_counter_t {
     int table_idx;
 };
 
-// Table traverser. It is supposed to return the latest canonical code slot.
-huffman_t *generate_entry(huffman_t *node, const table_root_t* table_root, const recursive_args_t* args, global_counter_t* counter) {
+static void write_ext_bits(unsigned char* ext_lut, unsigned index, unsigned bits) {
+    ext_lut[index >> 2] |= bits << (2 * (index & 3));
+}
+
+// Fill n entries of the current table, starting at args->code, with a max canonical symbol.
+// max_lut only keeps the low 8 bits; for bigger alphabets, the first entry to reach 256 / 512
+// goes in the table's cutoff_lut. Entries of a table are always filled left to right.
+static void set_max_entries(const table_root_t* table_root, const recursive_args_t* args, int n, int canon) {
+    if (args->code < 8) // The lower 8 entries
+        memset(&args->lower_max_lut[args->code], canon & 0xff, n);
+    else // The upper 8 entries
+        memset(&args->upper_max_lut[args->code - 8], canon & 0xff, n);
+    if (table_root->cutoff_lut) {
+        unsigned char* cutoff = table_root->cutoff_lut + 2 * ((args->next_table - table_root->next_table) / 16);
+        for (int k = 0; k < 2; k++)
+            if (canon >= 256 * (k + 1) && cutoff[k] > args->code) cutoff[k] = args->code;
+    }
+}
+
+// Table traverser. The tree is left untouched; it's freed with its arena.
+void generate_entry(const huffman_t *node, const table_root_t* table_root, const recursive_args_t* args, global_counter_t* counter) {
     // If we reach a leaf node...
     if (!node->left && !node->right) {
         // write current canonical code
         table_root->canonical_lut[node->symbol] = counter->current_canon;
         table_root->canonical_decode_lut[counter->current_canon] = node->symbol;
+        if (table_root->canonical_ext_lut) {
+            write_ext_bits(table_root->canonical_ext_lut, node->symbol, counter->current_canon >> 8);
+            write_ext_bits(table_root->canonical_decode_ext_lut, counter->current_canon, node->symbol >> 8);
+        }
         // All "virtual leaf" under the current leaf node in the table will be filled in
         // the same content. 
         int n_virtual_leaves = 1 << (3 - args->level);
         // Fill in 0 to the corresponding entries for these leaves in next_table
         memset(&args->next_table[args->code], 0, n_virtual_leaves);
         // Fill in the symbol to the current max_lut
-        if (args->code < 8) // The lower 8 entries
-            memset(&args->lower_max_lut[args->code], counter->current_canon, n_virtual_leaves);
-        else // The upper 8 entries
-            memset(&args->upper_max_lut[args->code - 8], counter->current_canon, n_virtual_leaves);
+        set_max_entries(table_root, args, n_virtual_leaves, counter->current_canon);
         // Update pointer to the next available canonical code
         counter->current_canon++;
     }
     // If we are at a intermediate node at level 3...
     else if (args->level == 3) {
+        // The table arrays are sized for the hardware. build_limited_huffman_tree() never gets here.
+        if (counter->table_idx >= HUFFMAN_MAX_TABLES) {
+            fprintf(stderr, "generate_table needs more than %d tables\n", HUFFMAN_MAX_TABLES);
+            exit(-1);
+        }
         // Set next_table to the next available table slot
         args->next_table[args->code] = counter->table_idx;
         // Build new argument structure 
@@ -114,55 +397,40 @@ huffman_t *generate_entry(huffman_t *node, const table_root_t* table_root, const
         counter->table_idx++;
         // Call recursively for the left branch
         next_args.code = 0;
-        node->left = generate_entry(node->left, table_root, &next_args, counter);
+        generate_entry(node->left, table_root, &next_args, counter);
         // After the recursive call on the left child finished, we can now determine 
         // the max symbol in this subtree very easily
         int max_symbol = node->right->num_symbol + counter->current_canon - 1;
-        if (args->code < 8) // The lower 8 entries
-            args->lower_max_lut[args->code] = max_symbol;
-        else // The upper 8 entries
-            args->upper_max_lut[args->code - 8] = max_symbol;
+        set_max_entries(table_root, args, 1, max_symbol);
         // Finish the right tree
         next_args.code = 8;
-        node->right = generate_entry(node->right, table_root, &next_args, counter);
+        generate_entry(node->right, table_root, &next_args, counter);
     }
     // Otherwise...
     else {
         // We run recursively on left and right node.
         recursive_args_t next_args = *args;
         next_args.level++;
-        node->left = generate_entry(node->left, table_root, &next_args, counter);
+        generate_entry(node->left, table_root, &next_args, counter);
         next_args.code += (1 << (2 - args->level));
-        node->right = generate_entry(node->right, table_root, &next_args, counter);
+        generate_entry(node->right, table_root, &next_args, counter);
     }
-    // Before we return, clean up the node
-    delete node;
-    return NULL;
 }
 
-// Read table from the scratchpad and generate requried lookup table.
-size_t generate_table(struct table_root_t* result, const unsigned* freq, short nsymbols) {
-    if (nsymbols > 256) {
-        fprintf(stderr, "generate_table doesn't support nsymbols > 256\n");
-        exit(-1);
-    }
-    auto root = build_huffman_tree(freq, nsymbols);
-    
-    // Traverse the node and build tables
-    // Even if nsymbols < 256, we still create a 256 table for convenience.
-    struct table_root_t* table_root = result;
-    table_root->canonical_lut = new unsigned char[256];
-    table_root->canonical_decode_lut = new unsigned char[256];
-    table_root->next_table = new unsigned char[16 * 64];
-    table_root->upper_max_lut = new unsigned char[8 * 64];
-    table_root->lower_max_lut = new unsigned char[8 * 64];
-    // To avoid undefined behavior, initialize all of these to 0. 
+// Clear the tables and fill them from the tree. The arrays are already allocated.
+static size_t fill_tables(struct table_root_t* table_root, const huffman_t* root, int canonical_size) {
+    // To avoid undefined behavior, initialize all of these to 0.
     // (Not technically correct for canonical_lut but sufficient)
-    memset(table_root->canonical_lut, 0, 256);
-    memset(table_root->canonical_decode_lut, 0, 256);
-    memset(table_root->next_table, 0, 16 * 64);
-    memset(table_root->upper_max_lut, 0, 8 * 64);
-    memset(table_root->lower_max_lut, 0, 8 * 64);
+    memset(table_root->canonical_lut, 0, canonical_size);
+    memset(table_root->canonical_decode_lut, 0, canonical_size);
+    memset(table_root->next_table, 0, 16 * HUFFMAN_MAX_TABLES);
+    memset(table_root->upper_max_lut, 0, 8 * HUFFMAN_MAX_TABLES);
+    memset(table_root->lower_max_lut, 0, 8 * HUFFMAN_MAX_TABLES);
+    if (table_root->cutoff_lut) {
+        memset(table_root->cutoff_lut, 16, 2 * HUFFMAN_MAX_TABLES);
+        memset(table_root->canonical_ext_lut, 0, EXT_LUT_SIZE);
+        memset(table_root->canonical_decode_ext_lut, 0, EXT_LUT_SIZE);
+    }
 
     // Prepare global counter
     struct global_counter_t counter;
@@ -181,11 +449,290 @@ size_t generate_table(struct table_root_t* result, const unsigned* freq, short n
     generate_entry(root, table_root, &args, &counter);
 
     // Return number of tables used
-    return counter.table_idx + 1;
+    return counter.table_idx;
+}
+
+// Generate the lookup tables for an already built tree. Free them with free_table().
+size_t generate_table_from_tree(struct table_root_t* result, const huffman_t* root) {
+    // Traverse the node and build tables
+    // Even if nsymbols < 256, we still create a 256 table for convenience.
+    // Bigger alphabets get tables for all HUFFMAN_MAX_SYMBOLS symbols and the extension tables.
+    bool extended = root->num_symbol > 256;
+    int canonical_size = extended ? HUFFMAN_MAX_SYMBOLS : 256;
+    result->canonical_lut = new unsigned char[canonical_size];
+    result->canonical_decode_lut = new unsigned char[canonical_size];
+    result->next_table = new unsigned char[16 * HUFFMAN_MAX_TABLES];
+    result->upper_max_lut = new unsigned char[8 * HUFFMAN_MAX_TABLES];
+    result->lower_max_lut = new unsigned char[8 * HUFFMAN_MAX_TABLES];
+    result->cutoff_lut = NULL;
+    result->canonical_ext_lut = NULL;
+    result->canonical_decode_ext_lut = NULL;
+    if (extended) {
+        result->cutoff_lut = new unsigned char[2 * HUFFMAN_MAX_TABLES];
+        result->canonical_ext_lut = new unsigned char[EXT_LUT_SIZE];
+        result->canonical_decode_ext_lut = new unsigned char[EXT_LUT_SIZE];
+    }
+    return fill_tables(result, root, canonical_size);
+}
+
+// Generate the tables for a tree of a byte alphabet straight into an image laid out like
+// write_table_image(), without any allocation. Return the number of tables used.
+size_t generate_table_image(const huffman_t* root, unsigned char* image) {
+    if (root->num_symbol > 256) {
+        fprintf(stderr, "generate_table_image doesn't support nsymbols > 256\n");
+        exit(-1);
+    }
+    struct table_root_t table;
+    map_table_image(&table, image);
+    return fill_tables(&table, root, 256);
+}
+
+// Free tables made by generate_table_from_tree() or generate_table()
+void free_table(struct table_root_t* table) {
+    delete [] table->canonical_lut;
+    delete [] table->canonical_decode_lut;
+    delete [] table->next_table;
+    delete [] table->upper_max_lut;
+    delete [] table->lower_max_lut;
+    delete [] table->cutoff_lut;
+    delete [] table->canonical_ext_lut;
+    delete [] table->canonical_decode_ext_lut;
+}
+
+// Read table from the scratchpad and generate requried lookup table.
+// The tree is length limited if needed, so the result always fits in max_tables tables.
+// If fast is given, the single-lookup decode table for the same code is filled in as well.
+size_t generate_table(struct table_root_t* result, const unsigned* freq, short nsymbols, short max_length, int max_tables,
+    length_limit_report_t* report, fast_decode_table_t* fast) {
+    if (nsymbols > HUFFMAN_MAX_SYMBOLS) {
+        fprintf(stderr, "generate_table doesn't support nsymbols > %d\n", HUFFMAN_MAX_SYMBOLS);
+        exit(-1);
+    }
+    if (fast && nsymbols > 256) {
+        fprintf(stderr, "generate_table only makes fast decode tables for nsymbols <= 256\n");
+        exit(-1);
+    }
+    huffman_arena_t arena;
+    auto root = build_limited_huffman_tree(freq, nsymbols, max_length, max_tables, &arena, report);
+    if (fast) {
+        huffman_code_t codes[256];
+        for (int i = nsymbols; i < 256; i++) codes[i].length = 0;
+        generate_code_table(root, codes);
+        generate_fast_decode_table(codes, fast);
+    }
+    return generate_table_from_tree(result, root);
+}
+
+static void generate_code_entry(const huffman_t* node, uint64_t code, short length, huffman_code_t* codes) {
+    if (!node->left && !node->right) {
+        codes[node->symbol].code = code;
+        codes[node->symbol].length = length;
+        return;
+    }
+    generate_code_entry(node->left, code << 1, length + 1, codes);
+    generate_code_entry(node->right, (code << 1) | 1, length + 1, codes);
+}
+
+// Flatten the tree into a (code, length) table indexed by symbol, so the encoder
+// doesn't need to walk the tree for every symbol.
+// Codes longer than 64 bits only keep their lowest 64 bits. Trees from
+// build_limited_huffman_tree() never have them.
+void generate_code_table(const huffman_t* root, huffman_code_t* codes) {
+    // A tree with a single leaf still needs one bit per symbol
+    if (!root->left && !root->right) {
+        codes[root->symbol].code = 0;
+        codes[root->symbol].length = 1;
+        return;
+    }
+    generate_code_entry(root, 0, 0, codes);
+}
+
+static void collect_codes(const struct table_root_t* table, int table_idx, uint64_t prefix, short depth,
+    huffman_code_t* codes) {
+    for (int entry = 0; entry < 16;) {
+        int next = table->next_table[table_idx * 16 + entry];
+        if (next) {
+            collect_codes(table, next, prefix << 4 | entry, depth + 4, codes);
+            entry++;
+            continue;
+        }
+        // A leaf covers 2^(4 - length) entries with the same max symbol (see decode_huffman())
+        const unsigned char* max_lut = (entry & 8 ? table->upper_max_lut : table->lower_max_lut) + table_idx * 8;
+        int e = entry & 7;
+        int length = 1 + (max_lut[0] != max_lut[7]) + (max_lut[e & 4] != max_lut[e | 3])
+            + (max_lut[e & 6] != max_lut[e | 1]);
+        huffman_code_t* code = &codes[table->canonical_decode_lut[max_lut[e]]];
+        code->code = prefix << length | entry >> (4 - length);
+        code->length = depth + length;
+        entry += 1 << (4 - length);
+    }
+}
+
+// Recover the flat code table from the lookup tables of a byte alphabet (e.g. a mapped table image).
+// Symbols that aren't in the tables keep length 0.
+void generate_code_table_from_tables(const struct table_root_t* table, huffman_code_t* codes) {
+    for (int s = 0; s < 256; s++) codes[s].length = 0;
+    collect_codes(table, 0, 0, 0, codes);
+}
+
+// Serialize the tables into one image (the content of data/table.dat)
+void write_table_image(const struct table_root_t* table, unsigned char* image) {
+    memcpy(image, table->next_table, 16 * HUFFMAN_MAX_TABLES);
+    image += 16 * HUFFMAN_MAX_TABLES;
+    memcpy(image, table->upper_max_lut, 8 * HUFFMAN_MAX_TABLES);
+    image += 8 * HUFFMAN_MAX_TABLES;
+    memcpy(image, table->lower_max_lut, 8 * HUFFMAN_MAX_TABLES);
+    image += 8 * HUFFMAN_MAX_TABLES;
+    memcpy(image, table->canonical_lut, 256);
+    memcpy(image + 256, table->canonical_decode_lut, 256);
+}
+
+// Point the tables into an image written by write_table_image(). Nothing is copied, so the
+// image must stay alive as long as the tables are used. The tables are only meant to be read.
+void map_table_image(struct table_root_t* table, const unsigned char* image) {
+    unsigned char* base = (unsigned char*) image;
+    table->next_table = base;
+    table->upper_max_lut = base + 16 * HUFFMAN_MAX_TABLES;
+    table->lower_max_lut = base + 24 * HUFFMAN_MAX_TABLES;
+    table->canonical_lut = base + 32 * HUFFMAN_MAX_TABLES;
+    table->canonical_decode_lut = base + 32 * HUFFMAN_MAX_TABLES + 256;
+    table->cutoff_lut = NULL;
+    table->canonical_ext_lut = NULL;
+    table->canonical_decode_ext_lut = NULL;
+}
+
+static void write_le16(unsigned char* dst, unsigned value) {
+    dst[0] = value;
+    dst[1] = value >> 8;
+}
+
+static unsigned read_le16(const unsigned char* src) {
+    return src[0] | src[1] << 8;
+}
+
+static uint32_t fnv1a(const unsigned char* data, size_t length, uint32_t hash) {
+    for (size_t i = 0; i < length; i++) hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+// Used size of each section of a packed image, in body order, and the size of the SRAM
+// region it gets (a power of two)
+static void packed_sections(size_t n_table, size_t* used, size_t* padded) {
+    size_t n_slots = 1;
+    while (n_slots < n_table) n_slots <<= 1;
+    const size_t entries[PACKED_TABLE_SECTIONS] = { 16, 8, 8, 0, 0 };
+    for (int i = 0; i < PACKED_TABLE_SECTIONS; i++) {
+        used[i] = entries[i] ? entries[i] * n_table : 256;
+        padded[i] = entries[i] ? entries[i] * n_slots : 256;
+    }
+}
+
+static uint32_t packed_table_hash(const unsigned char* image, size_t body_size) {
+    uint32_t hash = fnv1a(image, 20, 2166136261u);
+    return fnv1a(image + PACKED_TABLE_HEADER_SIZE, body_size, hash);
+}
+
+// Body size in bytes of a packed image with n_table tables (a multiple of 8)
+size_t packed_table_body_size(size_t n_table) {
+    return 32 * n_table + 2 * 256;
+}
+
+// Serialize the first n_table tables of a byte alphabet into a packed image, laid out as
+// described at PACKED_TABLE_MAGIC. image must hold PACKED_TABLE_MAX_SIZE bytes.
+// Return the image size, or 0 if the tables don't fit the format.
+size_t write_packed_table_image(const struct table_root_t* table, size_t n_table, unsigned char* image) {
+    if (table->cutoff_lut || n_table == 0 || n_table > HUFFMAN_MAX_TABLES) {
+        fprintf(stderr, "write_packed_table_image doesn't support %zu tables%s\n", n_table,
+            table->cutoff_lut ? " over 256 symbols" : "");
+        return 0;
+    }
+    const unsigned char* sections[PACKED_TABLE_SECTIONS] = { table->next_table, table->upper_max_lut,
+        table->lower_max_lut, table->canonical_lut, table->canonical_decode_lut };
+    size_t used[PACKED_TABLE_SECTIONS], padded[PACKED_TABLE_SECTIONS];
+    packed_sections(n_table, used, padded);
+
+    memset(image, 0, PACKED_TABLE_HEADER_SIZE);
+    unsigned char* body = image + PACKED_TABLE_HEADER_SIZE;
+    for (int i = 0; i < PACKED_TABLE_SECTIONS; i++) {
+        memcpy(body, sections[i], used[i]);
+        body += used[i];
+    }
+    // SRAM regions go largest first. The sizes are powers of two, so every base is a multiple of its size.
+    int order[PACKED_TABLE_SECTIONS] = { 0, 1, 2, 3, 4 };
+    std::stable_sort(order, order + PACKED_TABLE_SECTIONS, [&](int a, int b) { return padded[a] > padded[b]; });
+    size_t base = 0;
+    for (int i : order) {
+        write_le16(image + 8 + 2 * i, base);
+        base += padded[i];
+    }
+    size_t body_size = packed_table_body_size(n_table);
+    memcpy(image, PACKED_TABLE_MAGIC, 4);
+    image[4] = PACKED_TABLE_VERSION;
+    image[5] = n_table;
+    write_le16(image + 6, body_size / 8);
+    uint32_t hash = packed_table_hash(image, body_size);
+    for (int i = 0; i < 4; i++) image[20 + i] = hash >> (8 * i);
+    return PACKED_TABLE_HEADER_SIZE + body_size;
+}
+
+// The decoders follow next_table blindly, so check that every walk ends inside the tables
+// we have. Tables are numbered after the table that points to them (the generator numbers
+// them in preorder, static_table.h breadth first), so every link must go to a later table
+// below n_table. A link back to the same or an earlier table could loop forever.
+bool check_next_table(const unsigned char* next_table, size_t n_table) {
+    for (size_t i = 0; i < 16 * n_table; i++)
+        if (next_table[i] && (next_table[i] <= i / 16 || next_table[i] >= n_table)) return false;
+    return true;
+}
+
+// Point the tables into a packed image in place, like map_table_image().
+// Return the image size, or 0 if it's broken or longer than length.
+size_t map_packed_table_image(struct table_root_t* table, const unsigned char* image, size_t length) {
+    if (length < PACKED_TABLE_HEADER_SIZE || memcmp(image, PACKED_TABLE_MAGIC, 4) || image[4] != PACKED_TABLE_VERSION)
+        return 0;
+    size_t n_table = image[5];
+    size_t body_size = read_le16(image + 6) * 8;
+    if (n_table == 0 || n_table > HUFFMAN_MAX_TABLES || body_size != packed_table_body_size(n_table)
+        || body_size > length - PACKED_TABLE_HEADER_SIZE)
+        return 0;
+    uint32_t hash = image[20] | image[21] << 8 | image[22] << 16 | (uint32_t) image[23] << 24;
+    if (packed_table_hash(image, body_size) != hash) return 0;
+    unsigned char* body = (unsigned char*) image + PACKED_TABLE_HEADER_SIZE;
+    if (!check_next_table(body, n_table)) return 0;
+    table->next_table = body;
+    table->upper_max_lut = body + 16 * n_table;
+    table->lower_max_lut = body + 24 * n_table;
+    table->canonical_lut = body + 32 * n_table;
+    table->canonical_decode_lut = body + 32 * n_table + 256;
+    table->cutoff_lut = NULL;
+    table->canonical_ext_lut = NULL;
+    table->canonical_decode_ext_lut = NULL;
+    return PACKED_TABLE_HEADER_SIZE + body_size;
+}
+
+// Serialize tables for an alphabet over 256 symbols, laid out as described at EXTENDED_TABLE_IMAGE_SIZE.
+// The unused slots are 0.
+void write_extended_table_image(const struct table_root_t* table, unsigned char* image) {
+    memset(image, 0, EXTENDED_TABLE_IMAGE_SIZE);
+    memcpy(image, table->next_table, 16 * HUFFMAN_MAX_TABLES);
+    memcpy(image + 16 * HUFFMAN_MAX_TABLES, table->upper_max_lut, 8 * HUFFMAN_MAX_TABLES);
+    memcpy(image + 24 * HUFFMAN_MAX_TABLES, table->lower_max_lut, 8 * HUFFMAN_MAX_TABLES);
+    memcpy(image + EXTENDED_CANONICAL_OFFSET, table->canonical_lut, HUFFMAN_MAX_SYMBOLS);
+    memcpy(image + EXTENDED_CANONICAL_OFFSET + 1024, table->canonical_decode_lut, HUFFMAN_MAX_SYMBOLS);
+    memcpy(image + EXTENDED_EXT_OFFSET, table->canonical_ext_lut, EXT_LUT_SIZE);
+    memcpy(image + EXTENDED_EXT_OFFSET + 256, table->canonical_decode_ext_lut, EXT_LUT_SIZE);
+    memcpy(image + EXTENDED_CUTOFF_OFFSET, table->cutoff_lut, 2 * HUFFMAN_MAX_TABLES);
 }
 
-void delete_huffman_tree(huffman_t* root) {
-    if (root->left) delete_huffman_tree(root->left);
-    if (root->right) delete_huffman_tree(root->right);
-    delete root;
+// Point the tables into an image written by write_extended_table_image(), like map_table_image().
+void map_extended_table_image(struct table_root_t* table, const unsigned char* image) {
+    unsigned char* base = (unsigned char*) image;
+    table->next_table = base;
+    table->upper_max_lut = base + 16 * HUFFMAN_MAX_TABLES;
+    table->lower_max_lut = base + 24 * HUFFMAN_MAX_TABLES;
+    table->canonical_lut = base + EXTENDED_CANONICAL_OFFSET;
+    table->canonical_decode_lut = base + EXTENDED_CANONICAL_OFFSET + 1024;
+    table->canonical_ext_lut = base + EXTENDED_EXT_OFFSET;
+    table->canonical_decode_ext_lut = base + EXTENDED_EXT_OFFSET + 256;
+    table->cutoff_lut = base + EXTENDED_CUTOFF_OFFSET;
 }
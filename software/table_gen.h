@@ -1,13 +1,15 @@
 #ifndef TABLE_GEN_H_
 #define TABLE_GEN_H_
 
+#include <stdint.h>
+
 #define STIMULUS_GENERATE
 
 // Temporary Huffman tree cell
 struct huffman_t {
     // For leaf node, this is the symbol it represents.
     // For internal node, this is the max symbol under this branch. 
-    unsigned char symbol;
+    unsigned short symbol;
     short height;
     short num_symbol;
     unsigned int weight;
@@ -18,22 +20,174 @@ struct huffman_t {
 #endif
 };
 
+// Largest alphabet supported (Brotli). DEFLATE literal/length codes use 288.
+// Above 256 symbols, the canonical symbols need 9 or 10 bits; see table_root_t.
+#define HUFFMAN_MAX_SYMBOLS 704
+// The hardware has a 6-bit table index (see HuffmanEncoder)
+#define HUFFMAN_MAX_TABLES 64
+// The software encoder keeps a whole code in 64 bits
+#define HUFFMAN_MAX_CODE_LENGTH 64
+
+// Backing storage for one Huffman tree. A tree of n symbols uses exactly 2n - 1 nodes,
+// so a whole tree is built without any heap allocation and freed all at once.
+struct huffman_arena_t {
+    huffman_t nodes[2 * HUFFMAN_MAX_SYMBOLS - 1];
+};
+
 // The root of the tables involved. For next_table and max_table, this is the location of table 0.
+// For alphabets over 256 symbols, the max_lut and canonical tables only hold the low 8 bits,
+// and the 9th / 10th bits come from the extension tables (NULL for byte alphabets):
+// - canonical_ext_lut / canonical_decode_ext_lut: the high 2 bits of canonical_lut /
+//   canonical_decode_lut, packed 4 entries per byte (see read_ext_bits()).
+// - cutoff_lut: 2 entries per table, the first of the 16 entries whose max canonical symbol
+//   is >= 256 and >= 512 (16 if none). The entries of a table are in increasing order, so
+//   the high bits of entry e are (e >= cutoff[0]) + (e >= cutoff[1]): two comparators per
+//   hop in place of 2 more bits on all 16 entries.
 struct table_root_t {
     unsigned char* canonical_lut;
     unsigned char* canonical_decode_lut;
     unsigned char* next_table;
     unsigned char* upper_max_lut;
     unsigned char* lower_max_lut;
+    unsigned char* cutoff_lut;
+    unsigned char* canonical_ext_lut;
+    unsigned char* canonical_decode_ext_lut;
+};
+
+// The 2 high bits of entry index in a packed extension table
+static inline unsigned read_ext_bits(const unsigned char* ext_lut, unsigned index) {
+    return (ext_lut[index >> 2] >> (2 * (index & 3))) & 3;
+}
+
+// The 2 high bits of entry (0-15) of a table from its cutoff_lut entries
+static inline unsigned cutoff_bits(const unsigned char* cutoff, unsigned entry) {
+    return (entry >= cutoff[0]) + (entry >= cutoff[1]);
+}
+
+// Size of a table image laid out like data/table.dat: next_table, upper_max_lut,
+// lower_max_lut, canonical_lut, canonical_decode_lut, each at its full size.
+#define TABLE_IMAGE_SIZE (16 * HUFFMAN_MAX_TABLES + 2 * 8 * HUFFMAN_MAX_TABLES + 2 * 256)
+
+// Table image for alphabets over 256 symbols. Every section starts at a multiple of its
+// size rounded up to a power of two, so the hardware can OR the index into a base register:
+// next_table, upper_max_lut, lower_max_lut as above, then canonical_lut and
+// canonical_decode_lut (1024 slots each), canonical_ext_lut and canonical_decode_ext_lut
+// (256 slots each) and cutoff_lut.
+#define EXT_LUT_SIZE (HUFFMAN_MAX_SYMBOLS / 4)
+#define EXTENDED_CANONICAL_OFFSET (32 * HUFFMAN_MAX_TABLES)
+#define EXTENDED_EXT_OFFSET (EXTENDED_CANONICAL_OFFSET + 2 * 1024)
+#define EXTENDED_CUTOFF_OFFSET (EXTENDED_EXT_OFFSET + 2 * 256)
+#define EXTENDED_TABLE_IMAGE_SIZE (EXTENDED_CUTOFF_OFFSET + 2 * HUFFMAN_MAX_TABLES)
+
+// Packed table image for byte alphabets: a header, then a body with only the tables in use.
+// The body holds next_table, upper_max_lut, lower_max_lut, canonical_lut and
+// canonical_decode_lut back to back, each cut to its used size, so the software codec can
+// use it in place. It's a whole number of 64-bit lines (8 bytes, little endian), one per
+// SynthMem write. Each section also gets an SRAM base address that is a multiple of its
+// size rounded up to a power of two, so it can go straight into the base register the
+// hardware ORs the index into; the lines past the used size are never read and need not
+// be written.
+// Header: "HUFT", u8 version, u8 number of tables, u16 body size in lines,
+// u16 SRAM base of each section in the order above, 2 reserved bytes,
+// u32 FNV-1a hash of the header before it and the body. Little endian.
+#define PACKED_TABLE_MAGIC "HUFT"
+#define PACKED_TABLE_VERSION 1
+#define PACKED_TABLE_HEADER_SIZE 24
+#define PACKED_TABLE_SECTIONS 5
+#define PACKED_TABLE_MAX_SIZE (PACKED_TABLE_HEADER_SIZE + TABLE_IMAGE_SIZE)
+
+// Flat (code, length) entry for one symbol. The code is right aligned and sent MSB first
+// (the bit closest to the root comes first).
+struct huffman_code_t {
+    uint64_t code;
+    short length;
+};
+
+// Optional single-lookup decode table for the software decoder (byte alphabets only).
+// It's indexed by the next FAST_DECODE_BITS bits of the stream, and every entry holds all the
+// symbols whose codes fit completely in those bits, up to 3. If even the first code is longer,
+// the entry is empty and the decoder walks the multi-level tables instead.
+#define FAST_DECODE_BITS 11
+#define FAST_DECODE_MAX_SYMBOLS 3
+
+struct fast_decode_entry_t {
+    unsigned char symbols[FAST_DECODE_MAX_SYMBOLS];
+    unsigned char n_bits : 4; // Bits taken by the symbols
+    unsigned char n_symbols : 4; // 0 if the first code is longer than FAST_DECODE_BITS
+};
+
+struct fast_decode_table_t {
+    fast_decode_entry_t entries[1 << FAST_DECODE_BITS];
+};
+
+// Fill the single-lookup decode table for a byte alphabet code. Symbols with length 0 don't
+// have a code. The first symbol of every index is found by filling in all the indices that
+// start with its code; the next symbols then come from the entry at the index shifted
+// past the codes already taken, as long as their codes are still inside the known bits.
+// It's constexpr so static_table.h can build the table at compile time.
+constexpr void generate_fast_decode_table(const huffman_code_t* codes, fast_decode_table_t* fast) {
+    const int size = 1 << FAST_DECODE_BITS;
+    unsigned char first_symbol[1 << FAST_DECODE_BITS] = {};
+    unsigned char first_length[1 << FAST_DECODE_BITS] = {};
+    for (int s = 0; s < 256; s++) {
+        int length = codes[s].length;
+        if (!length || length > FAST_DECODE_BITS) continue;
+        int start = codes[s].code << (FAST_DECODE_BITS - length);
+        int n = 1 << (FAST_DECODE_BITS - length);
+        for (int i = start; i < start + n; i++) {
+            first_symbol[i] = s;
+            first_length[i] = length;
+        }
+    }
+    for (int i = 0; i < size; i++) {
+        fast_decode_entry_t* entry = &fast->entries[i];
+        for (int k = 0; k < FAST_DECODE_MAX_SYMBOLS; k++) entry->symbols[k] = 0;
+        int n_bits = 0;
+        int n_symbols = 0;
+        while (n_symbols < FAST_DECODE_MAX_SYMBOLS) {
+            int next = (i << n_bits) & (size - 1);
+            int length = first_length[next];
+            if (!length || n_bits + length > FAST_DECODE_BITS) break;
+            entry->symbols[n_symbols++] = first_symbol[next];
+            n_bits += length;
+        }
+        entry->n_bits = n_bits;
+        entry->n_symbols = n_symbols;
+    }
+}
+
+// What build_limited_huffman_tree() had to give up to fit the limits.
+struct length_limit_report_t {
+    bool limited; // The plain Huffman tree didn't fit and was replaced
+    short max_length; // Longest code in the final tree
+    int n_table; // Tables used by the final tree
+    uint64_t huffman_bits; // Encoded size in bits with the plain Huffman code
+    uint64_t limited_bits; // Encoded size in bits with the final code
 };
 
-huffman_t* build_huffman_tree(const unsigned* freq, short nsymbols
+huffman_t* build_huffman_tree(const unsigned* freq, short nsymbols, huffman_arena_t* arena
 #ifdef STIMULUS_GENERATE
     , huffman_t** encode_table = NULL
 #endif
 );
-size_t generate_table(struct table_root_t* result, const unsigned* freq, short nsymbols);
-void delete_huffman_tree(huffman_t* root);
+huffman_t* build_limited_huffman_tree(const unsigned* freq, short nsymbols, short max_length, int max_tables,
+    huffman_arena_t* arena, length_limit_report_t* report = NULL);
+size_t generate_table_from_tree(struct table_root_t* result, const huffman_t* root);
+size_t generate_table_image(const huffman_t* root, unsigned char* image);
+void free_table(struct table_root_t* table);
+size_t generate_table(struct table_root_t* result, const unsigned* freq, short nsymbols,
+    short max_length = HUFFMAN_MAX_CODE_LENGTH, int max_tables = HUFFMAN_MAX_TABLES, length_limit_report_t* report = NULL,
+    fast_decode_table_t* fast = NULL);
+void generate_code_table(const huffman_t* root, huffman_code_t* codes);
+void generate_code_table_from_tables(const struct table_root_t* table, huffman_code_t* codes);
+void write_table_image(const struct table_root_t* table, unsigned char* image);
+void map_table_image(struct table_root_t* table, const unsigned char* image);
+bool check_next_table(const unsigned char* next_table, size_t n_table);
+size_t packed_table_body_size(size_t n_table);
+size_t write_packed_table_image(const struct table_root_t* table, size_t n_table, unsigned char* image);
+size_t map_packed_table_image(struct table_root_t* table, const unsigned char* image, size_t length);
+void write_extended_table_image(const struct table_root_t* table, unsigned char* image);
+void map_extended_table_image(struct table_root_t* table, const unsigned char* image);
 void print_huffman_tree(huffman_t* root);
 
 #endif
\ No newline at end of file
@@ -1,14 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
 
 #include "table_gen.h"
 #include "software_model.h"
+#include "block_codec.h"
+#include "histogram.h"
+#include "hw_model.h"
+#include "table_cache.h"
+#include "table_update.h"
+#include "table_batch.h"
+#include "block_stats.h"
+#include "static_table.h"
 
 void test_ht() {
     // A frequency table of 8 symbols. This is a classic example to show how Huffman trees work.
     unsigned weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
-    auto root = build_huffman_tree(weights, 8);
+    huffman_arena_t arena;
+    auto root = build_huffman_tree(weights, 8, &arena);
 
     // Reference output for symbol order. Remember that we are producing a canonical tree.
     unsigned char leaf_symbol_ref[] = {7, 6, 5, 4, 3, 2, 0, 1};
@@ -27,11 +39,8 @@ void test_ht() {
         assert(root->left->num_symbol == 1);
         assert(!root->left->left);
         assert(!root->left->right);
-        // Clean up and move onto the next internal node (on the right).
-        auto next_root = root->right;
-        delete root->left;
-        delete root;
-        root = next_root;
+        // Move onto the next internal node (on the right).
+        root = root->right;
     }
     // Now we are at the last node. Check the property.
     assert(root);
@@ -40,8 +49,8 @@ void test_ht() {
     assert(root->num_symbol == 1);
     assert(!root->left);
     assert(!root->right);
-    // Clean up.
-    delete root;
+    // Every node lives in the arena, with the root created last.
+    assert(root >= arena.nodes && root < arena.nodes + 15);
 }
 
 void test_generate_table() {
@@ -85,11 +94,7 @@ void test_generate_table() {
         assert(next_table1_ref[i] == next_table1[i]);
 
     // Cleanup
-    delete [] table_root.canonical_lut;
-    delete [] table_root.canonical_decode_lut;
-    delete [] table_root.next_table;
-    delete [] table_root.upper_max_lut;
-    delete [] table_root.lower_max_lut;
+    free_table(&table_root);
 }
 
 void test_output_stream() {
@@ -131,6 +136,903 @@ void test_huffman_ref(bool align, bool exact_byte) {
         assert(out[i] == output_ref[i]);   
 }
 
+void test_huffman_decode() {
+    // Round trip the string in test_huffman_ref first
+    const unsigned char* data = (const unsigned char*) "abbccccdddddd";
+    unsigned char out[32] = {0};
+    unsigned char decoded[32] = {0};
+    struct table_root_t table;
+    size_t n_table;
+    size_t code_length = generate_huffman_ref(data, 13, out, 32, &table, &n_table);
+    assert(decode_huffman(&table, out, code_length, decoded, 13) == code_length);
+    for (size_t i = 0; i < 13; i++)
+        assert(decoded[i] == data[i]);
+    free_table(&table);
+
+    // Then a skewed source with codes long enough to go through a few tables.
+    // Symbol i shows up roughly (3/4)^i of the time plus some noise, generated with a fixed LCG.
+    const size_t length = 4096;
+    unsigned char* source = (unsigned char*) malloc(length);
+    unsigned char* encoded = (unsigned char*) malloc(4 * length);
+    unsigned char* result = (unsigned char*) malloc(length);
+    unsigned seed = 1;
+    for (size_t i = 0; i < length; i++) {
+        int symbol = 0;
+        do {
+            seed = seed * 1103515245 + 12345;
+        } while (symbol < 255 && ((seed >> 16) & 3) != 0 && ++symbol);
+        // Mix in some uniform noise so every symbol has a nonzero count
+        source[i] = (i % 8 == 0) ? (seed >> 20) & 0xff : symbol;
+    }
+    code_length = generate_huffman_ref(source, length, encoded, 4 * length, &table, &n_table);
+    assert(decode_huffman(&table, encoded, code_length, result, length) == code_length);
+    for (size_t i = 0; i < length; i++)
+        assert(result[i] == source[i]);
+    free_table(&table);
+    free(source);
+    free(encoded);
+    free(result);
+}
+
+void test_fast_decode() {
+    // Skewed text: most codes are short enough to decode 2 or 3 at a time, a few need the table walk
+    const size_t length = 4096;
+    unsigned char* source = (unsigned char*) malloc(length);
+    unsigned char* encoded = (unsigned char*) malloc(length + 8);
+    unsigned char* result = (unsigned char*) malloc(length);
+    const char* text = "eeeeeeeetttttaaaooiinnsshrdlcumwfgypbvkjxqz";
+    unsigned seed = 7;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = i % 97 == 0 ? (seed >> 16) & 0xff : text[(seed >> 16) % 43];
+    }
+    unsigned freq[256];
+    count_frequency(source, length, freq);
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+    struct table_root_t table;
+    fast_decode_table_t* fast = new fast_decode_table_t;
+    generate_table(&table, freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, NULL, fast);
+    size_t code_length = encode_huffman(codes, source, length, encoded, length + 8);
+
+    // Every entry matches the codes it claims to hold
+    int n_multi = 0, n_empty = 0;
+    for (int i = 0; i < (1 << FAST_DECODE_BITS); i++) {
+        const fast_decode_entry_t* entry = &fast->entries[i];
+        int n_bits = 0;
+        for (int k = 0; k < entry->n_symbols; k++) {
+            const huffman_code_t* code = &codes[entry->symbols[k]];
+            n_bits += code->length;
+            assert(((i >> (FAST_DECODE_BITS - n_bits)) & ((1 << code->length) - 1)) == (int) code->code);
+        }
+        assert(n_bits == entry->n_bits);
+        n_multi += entry->n_symbols > 1;
+        n_empty += entry->n_symbols == 0;
+    }
+    assert(n_multi > 0 && n_empty > 0);
+
+    // The codes can be recovered from the tables alone, as decode_block() does
+    huffman_code_t recovered[256];
+    generate_code_table_from_tables(&table, recovered);
+    for (int s = 0; s < 256; s++)
+        assert(recovered[s].length == codes[s].length && recovered[s].code == codes[s].code);
+
+    // Same output and same size as the table walk, including the last few symbols
+    const size_t counts[] = {length, length - 1, length - 2, 3, 2, 1, 0};
+    for (size_t n : counts) {
+        memset(result, 0, length);
+        size_t ref_length = decode_huffman(&table, encoded, code_length, result, n);
+        memset(result, 0, length);
+        assert(decode_huffman_fast(&table, fast, encoded, code_length, result, n) == ref_length);
+        for (size_t i = 0; i < n; i++)
+            assert(result[i] == source[i]);
+    }
+    delete fast;
+    free_table(&table);
+    free(source);
+    free(encoded);
+    free(result);
+}
+
+void test_interleaved() {
+    const size_t length = 4096;
+    unsigned char* source = (unsigned char*) malloc(length);
+    unsigned char* encoded = (unsigned char*) malloc(length + INTERLEAVED_JUMP_TABLE_SIZE + 8);
+    unsigned char* result = (unsigned char*) malloc(length);
+    const char* text = "eeeeeeeetttttaaaooiinnsshrdlcumwfgypbvkjxqz";
+    unsigned seed = 11;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = i % 89 == 0 ? (seed >> 16) & 0xff : text[(seed >> 16) % 43];
+    }
+    unsigned freq[256];
+    count_frequency(source, length, freq);
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+    struct table_root_t table;
+    fast_decode_table_t* fast = new fast_decode_table_t;
+    generate_table(&table, freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, NULL, fast);
+
+    // Lengths that don't split evenly, and fewer symbols than streams
+    const size_t counts[] = {length, length - 1, length - 2, length - 3, 13, 5, 4, 3, 1, 0};
+    for (size_t n : counts) {
+        size_t code_length = encode_huffman_interleaved(codes, source, n, encoded, length + INTERLEAVED_JUMP_TABLE_SIZE + 8);
+        // The streams are the single-stream encodings of the 4 parts
+        size_t stream_sum = INTERLEAVED_JUMP_TABLE_SIZE;
+        for (int s = 0; s < INTERLEAVED_STREAMS - 1; s++)
+            stream_sum += encoded[4 * s] | encoded[4 * s + 1] << 8 | encoded[4 * s + 2] << 16
+                | (size_t) encoded[4 * s + 3] << 24;
+        size_t last = (n + 3) / 4 * 3 < n ? n - (n + 3) / 4 * 3 : 0;
+        unsigned char last_stream[length / 4 + 8];
+        size_t last_length = encode_huffman(codes, source + n - last, last, last_stream, sizeof(last_stream));
+        assert(code_length == stream_sum + last_length);
+        assert(!memcmp(encoded + stream_sum, last_stream, last_length));
+        for (int with_fast = 0; with_fast < 2; with_fast++) {
+            memset(result, 0, length);
+            assert(decode_huffman_interleaved(&table, with_fast ? fast : NULL, encoded, code_length, result, n)
+                == code_length);
+            for (size_t i = 0; i < n; i++)
+                assert(result[i] == source[i]);
+        }
+    }
+    // A jump table pointing past the end
+    encode_huffman_interleaved(codes, source, length, encoded, length + INTERLEAVED_JUMP_TABLE_SIZE + 8);
+    encoded[3] = 0xff;
+    assert(decode_huffman_interleaved(&table, fast, encoded, length, result, length) == 0);
+    assert(decode_huffman_interleaved(&table, fast, encoded, INTERLEAVED_JUMP_TABLE_SIZE - 1, result, 0) == 0);
+
+    delete fast;
+    free_table(&table);
+    free(source);
+    free(encoded);
+    free(result);
+}
+
+void test_encode_tables() {
+    // Skewed text, flat 8-bit codes, and a deep tree where most codes take several hops
+    unsigned freq[3][256];
+    const char* text = "eeeeeeeetttttaaaooiinnsshrdlcumwfgypbvkjxqz";
+    for (int s = 0; s < 256; s++) {
+        freq[0][s] = 1;
+        freq[1][s] = 100;
+        freq[2][s] = s < 40 ? 1u << (s / 2) : 1;
+    }
+    for (int i = 0; text[i]; i++) freq[0][(unsigned char) text[i]] += 50;
+    const size_t length = 4096;
+    unsigned char source[length];
+    unsigned seed = 5;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = i < 256 ? i : i % 3 ? text[(seed >> 16) % 43] : (seed >> 16) & 0xff;
+    }
+    unsigned char expected[8 * length], encoded[8 * length];
+    unsigned char image[PACKED_TABLE_MAX_SIZE];
+    for (int k = 0; k < 3; k++) {
+        huffman_arena_t arena;
+        huffman_t* root = build_limited_huffman_tree(freq[k], 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+        huffman_code_t codes[256];
+        generate_code_table(root, codes);
+        struct table_root_t table;
+        size_t n_table = generate_table_from_tree(&table, root);
+        if (k == 2) assert(codes[255].length > 16);
+        size_t expected_length = encode_huffman(codes, source, length, expected, sizeof(expected));
+        assert(encode_huffman_tables(&table, source, length, encoded, sizeof(encoded)) == expected_length);
+        assert(!memcmp(encoded, expected, expected_length));
+        // Straight from the image the accelerator gets
+        write_packed_table_image(&table, n_table, image);
+        struct table_root_t packed;
+        assert(map_packed_table_image(&packed, image, sizeof(image)));
+        memset(encoded, 0, expected_length);
+        assert(encode_huffman_tables(&packed, source, length, encoded, sizeof(encoded)) == expected_length);
+        assert(!memcmp(encoded, expected, expected_length));
+        free_table(&table);
+    }
+}
+
+// Flat 8-bit codes, and a spec that leaves half the code space unused
+constexpr static_code_lengths_t uniform_lengths(int length) {
+    static_code_lengths_t spec{};
+    for (int s = 0; s < 256; s++) spec.length[s] = length;
+    return spec;
+}
+inline constexpr static_table_t flat_static_table = make_static_table(uniform_lengths(8));
+static_assert(flat_static_table.valid && flat_static_table.n_table == 17, "flat codes take the root and 16 tables");
+static_assert(!make_static_table(uniform_lengths(9)).valid, "incomplete codes are rejected");
+static_assert(static_text_table.codes[' '].length < static_text_table.codes['e'].length
+    && static_text_table.codes['e'].length < static_text_table.codes['Z'].length, "the text model favours text");
+
+template <const static_table_t& static_table>
+void check_static_table(const unsigned char* source, size_t length) {
+    // The image is what the runtime would use for the same code
+    struct table_root_t table;
+    map_table_image(&table, static_table.image);
+    huffman_code_t recovered[256];
+    generate_code_table_from_tables(&table, recovered);
+    for (int s = 0; s < 256; s++)
+        assert(recovered[s].length == static_table.codes[s].length && recovered[s].code == static_table.codes[s].code);
+
+    std::vector<unsigned char> expected(length * 4 + 8), encoded(length * 4 + 8), result(length);
+    size_t expected_length = encode_huffman(static_table.codes, source, length, expected.data(), expected.size());
+    assert(encode_static<static_table>(source, length, encoded.data(), encoded.size()) == expected_length);
+    assert(!memcmp(encoded.data(), expected.data(), expected_length));
+    assert(encode_huffman_tables(&table, source, length, encoded.data(), encoded.size()) == expected_length);
+    assert(!memcmp(encoded.data(), expected.data(), expected_length));
+
+    // Decodes the same as the table walk, including the last few symbols and a truncated stream
+    const size_t counts[] = {length, length - 1, length - 2, 3, 2, 1, 0};
+    for (size_t n : counts) {
+        for (size_t truncate = 0; truncate < 2; truncate++) {
+            size_t input_length = truncate ? expected_length / 2 : expected_length;
+            std::fill(result.begin(), result.end(), 0);
+            size_t ref_length = decode_huffman(&table, expected.data(), input_length, result.data(), n);
+            std::vector<unsigned char> ref(result.begin(), result.begin() + n);
+            std::fill(result.begin(), result.end(), 0);
+            assert(decode_static<static_table>(expected.data(), input_length, result.data(), n) == ref_length);
+            assert(std::equal(ref.begin(), ref.end(), result.begin()));
+            if (!truncate) assert(!memcmp(result.data(), source, n));
+        }
+    }
+}
+
+void test_static_table() {
+    const size_t length = 4096;
+    unsigned char source[length];
+    const char* text = "The quick brown fox jumps over the lazy dog, 12 times.\n";
+    unsigned seed = 3;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = i % 61 == 0 ? (seed >> 16) & 0xff : text[i % strlen(text)];
+    }
+    check_static_table<static_text_table>(source, length);
+    check_static_table<flat_static_table>(source, length);
+    // Text takes fewer bits with the text model than with 8-bit codes
+    unsigned freq[256];
+    count_frequency(source, length, freq);
+    assert(code_cost_bits(static_text_table.codes, freq) < 6 * length);
+}
+
+void test_packed_table_image() {
+    // Flat 8-bit codes (the root and 16 leaf tables), then a deep tree with many more tables
+    unsigned freq[2][256];
+    for (int s = 0; s < 256; s++) {
+        freq[0][s] = 100;
+        freq[1][s] = s < 40 ? 1u << (s / 2) : 1;
+    }
+    for (int k = 0; k < 2; k++) {
+        struct table_root_t table;
+        size_t n_table = generate_table(&table, freq[k], 256);
+        unsigned char image[PACKED_TABLE_MAX_SIZE];
+        size_t size = write_packed_table_image(&table, n_table, image);
+        assert(size == PACKED_TABLE_HEADER_SIZE + packed_table_body_size(n_table));
+        assert(size % 8 == 0 && size <= PACKED_TABLE_MAX_SIZE);
+        if (k == 0) assert(n_table == 17 && size == PACKED_TABLE_HEADER_SIZE + 32 * 17 + 512);
+        else assert(n_table > 17);
+        // Every SRAM base is a multiple of the padded section size, so the hardware can OR into it
+        size_t n_slots = 1;
+        while (n_slots < n_table) n_slots <<= 1;
+        const size_t padded[PACKED_TABLE_SECTIONS] = { 16 * n_slots, 8 * n_slots, 8 * n_slots, 256, 256 };
+        for (int i = 0; i < PACKED_TABLE_SECTIONS; i++) {
+            size_t base = image[8 + 2 * i] | image[9 + 2 * i] << 8;
+            assert(base % padded[i] == 0 && base + padded[i] <= TABLE_IMAGE_SIZE);
+        }
+
+        // Mapped in place, the tables decode like the originals
+        struct table_root_t mapped;
+        assert(map_packed_table_image(&mapped, image, size + 100) == size);
+        assert(mapped.next_table >= image && mapped.canonical_decode_lut < image + size);
+        huffman_code_t codes[256], mapped_codes[256];
+        generate_code_table_from_tables(&table, codes);
+        generate_code_table_from_tables(&mapped, mapped_codes);
+        for (int s = 0; s < 256; s++) {
+            assert(codes[s].length == mapped_codes[s].length && codes[s].code == mapped_codes[s].code);
+            assert(mapped.canonical_lut[s] == table.canonical_lut[s]);
+        }
+
+        // Truncated, corrupted, or pointing past the tables it has
+        assert(map_packed_table_image(&mapped, image, size - 8) == 0);
+        image[size - 1] ^= 1;
+        assert(map_packed_table_image(&mapped, image, size) == 0);
+        image[size - 1] ^= 1;
+        image[4] = PACKED_TABLE_VERSION + 1;
+        assert(map_packed_table_image(&mapped, image, size) == 0);
+        image[4] = PACKED_TABLE_VERSION;
+        unsigned char link = table.next_table[1];
+        table.next_table[1] = n_table;
+        write_packed_table_image(&table, n_table, image);
+        assert(map_packed_table_image(&mapped, image, size) == 0);
+        table.next_table[1] = link;
+        // Links back to the same or an earlier table would loop forever, even with a good hash
+        for (unsigned target = 1; target <= 2; target++) {
+            unsigned char old = table.next_table[16 * 2];
+            table.next_table[16 * 2] = target;
+            assert(write_packed_table_image(&table, n_table, image) == size);
+            assert(map_packed_table_image(&mapped, image, size) == 0);
+            table.next_table[16 * 2] = old;
+        }
+        write_packed_table_image(&table, n_table, image);
+        assert(map_packed_table_image(&mapped, image, size) == size);
+
+        free_table(&table);
+    }
+}
+
+void test_length_limit() {
+    // Fibonacci weights give the deepest possible Huffman tree (39 bits here),
+    // far more than the 64 tables the hardware can hold.
+    unsigned weights[256] = {0};
+    weights[0] = weights[1] = 1;
+    for (int i = 2; i < 40; i++) weights[i] = weights[i - 1] + weights[i - 2];
+
+    huffman_arena_t arena;
+    length_limit_report_t report;
+    huffman_t* root = build_limited_huffman_tree(weights, 256, 16, HUFFMAN_MAX_TABLES, &arena, &report);
+    assert(report.limited);
+    assert(report.max_length <= 16);
+    assert(report.n_table <= HUFFMAN_MAX_TABLES);
+    assert(report.limited_bits >= report.huffman_bits);
+
+    // The codes must respect the limit, be complete, and add up to the reported size
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+    uint64_t bits = 0;
+    uint64_t kraft = 0;
+    for (int i = 0; i < 256; i++) {
+        assert(codes[i].length <= 16);
+        bits += (uint64_t) weights[i] * codes[i].length;
+        kraft += 1 << (16 - codes[i].length);
+    }
+    assert(bits == report.limited_bits);
+    assert(kraft == 1 << 16);
+
+    // The tables of the limited tree still decode what the codes encode
+    struct table_root_t table;
+    assert(generate_table_from_tree(&table, root) == (size_t) report.n_table);
+    unsigned char source[256];
+    unsigned char encoded[1024];
+    unsigned char decoded[256];
+    for (int i = 0; i < 256; i++) source[i] = i;
+    size_t code_length = encode_huffman(codes, source, 256, encoded, 1024);
+    assert(decode_huffman(&table, encoded, code_length, decoded, 256) == code_length);
+    for (int i = 0; i < 256; i++)
+        assert(decoded[i] == source[i]);
+    free_table(&table);
+
+    // 17 tables is the least 256 symbols can fit in (15 leaves and one link per table)
+    assert(generate_table(&table, weights, 256, HUFFMAN_MAX_CODE_LENGTH, 17, &report) <= 17);
+    assert(report.limited);
+    free_table(&table);
+
+    // A tree that fits is left alone
+    const unsigned small_weights[8] = { 1, 2, 4, 8, 16, 32, 64, 128 };
+    build_limited_huffman_tree(small_weights, 8, 16, HUFFMAN_MAX_TABLES, &arena, &report);
+    assert(!report.limited);
+    assert(report.max_length == 7);
+    assert(report.n_table == 2);
+    assert(report.limited_bits == report.huffman_bits);
+}
+
+void test_block_codec() {
+    // A bit more than 3 blocks, with the byte distribution changing between blocks
+    const size_t length = 3 * BLOCK_SIZE_MAX + 1000;
+    unsigned char* source = (unsigned char*) malloc(length);
+    unsigned seed = 7;
+    for (size_t i = 0; i < length; i++) {
+        seed = seed * 1103515245 + 12345;
+        int range = 4 << (i / BLOCK_SIZE_MAX);
+        source[i] = 'a' + (seed >> 16) % range;
+    }
+
+    // The stream must not depend on the number of threads
+    FILE* streams[2];
+    size_t stream_length[2];
+    for (int i = 0; i < 2; i++) {
+        struct block_options_t options;
+        options.block_size = BLOCK_SIZE_MAX;
+        options.n_threads = i == 0 ? 1 : 4;
+        options.interleaved = false;
+        options.stats = NULL;
+        options.min_gain = STORED_BLOCK_MIN_GAIN;
+        streams[i] = tmpfile();
+        stream_length[i] = encode_blocks(source, length, streams[i], &options);
+        assert(stream_length[i] == (size_t) ftell(streams[i]));
+    }
+    assert(stream_length[0] == stream_length[1]);
+    unsigned char* encoded[2];
+    for (int i = 0; i < 2; i++) {
+        encoded[i] = (unsigned char*) malloc(stream_length[i]);
+        rewind(streams[i]);
+        assert(fread(encoded[i], 1, stream_length[i], streams[i]) == stream_length[i]);
+        fclose(streams[i]);
+    }
+    for (size_t i = 0; i < stream_length[0]; i++)
+        assert(encoded[0][i] == encoded[1][i]);
+
+    // Round trip
+    unsigned char* decoded = (unsigned char*) malloc(length);
+    assert(decode_blocks(encoded[0], stream_length[0], decoded, length, 4) == length);
+    for (size_t i = 0; i < length; i++)
+        assert(decoded[i] == source[i]);
+    // Not enough room for the output
+    assert(decode_blocks(encoded[0], stream_length[0], decoded, length - 1, 4) == 0);
+    // A block of 2^15 bytes could have a frequency that doesn't fit the hardware's 15 bits
+    struct block_options_t too_big;
+    too_big.block_size = 1 << 15;
+    too_big.n_threads = 1;
+    too_big.interleaved = false;
+    too_big.stats = NULL;
+    too_big.min_gain = STORED_BLOCK_MIN_GAIN;
+    FILE* rejected = tmpfile();
+    assert(encode_blocks(source, length, rejected, &too_big) == 0);
+    fclose(rejected);
+    // A frame that indexes fine but whose table image fails its checksum
+    encoded[1][STREAM_HEADER_SIZE + BLOCK_HEADER_SIZE + PACKED_TABLE_HEADER_SIZE + 5] ^= 1;
+    assert(decode_blocks(encoded[1], stream_length[1], decoded, length, 4) == 0);
+
+    // Interleaved payloads are flagged in the header and decode the same
+    struct block_options_t options;
+    options.block_size = BLOCK_SIZE_MAX;
+    options.n_threads = 4;
+    options.interleaved = true;
+    std::vector<block_stats_t> stats;
+    options.stats = &stats;
+    options.min_gain = STORED_BLOCK_MIN_GAIN;
+    FILE* stream = tmpfile();
+    size_t interleaved_length = encode_blocks(source, length, stream, &options);
+    unsigned char* interleaved = (unsigned char*) malloc(interleaved_length);
+    rewind(stream);
+    assert(fread(interleaved, 1, interleaved_length, stream) == interleaved_length);
+    fclose(stream);
+    unsigned flags;
+    assert(read_stream_header(interleaved, interleaved_length, &flags)
+        && flags == (STREAM_FLAG_INTERLEAVED | STREAM_FLAG_PACKED_TABLES | STREAM_FLAG_STORED_BLOCKS));
+    assert(read_stream_header(encoded[0], stream_length[0], &flags)
+        && flags == (STREAM_FLAG_PACKED_TABLES | STREAM_FLAG_STORED_BLOCKS));
+    memset(decoded, 0, length);
+    assert(decode_blocks(interleaved, interleaved_length, decoded, length, 4) == length);
+    for (size_t i = 0; i < length; i++)
+        assert(decoded[i] == source[i]);
+    free(interleaved);
+
+    // The statistics add up to what was written
+    assert(stats.size() == 4);
+    size_t raw_total = 0, encoded_total = 0;
+    for (const block_stats_t& b : stats) {
+        raw_total += b.raw_bytes;
+        encoded_total += BLOCK_HEADER_SIZE + b.encoded_bytes;
+        if (!b.stored) encoded_total += PACKED_TABLE_HEADER_SIZE + packed_table_body_size(b.n_table);
+        uint64_t n_symbols = 0;
+        for (int l = 0; l <= HUFFMAN_MAX_CODE_LENGTH; l++) n_symbols += b.length_histogram[l];
+        assert(n_symbols == b.raw_bytes);
+        assert(b.achieved_bits >= b.entropy_bits);
+        assert(b.achieved_bits * b.raw_bytes / 8 <= b.encoded_bytes);
+        if (!b.stored) assert(b.achieved_bits < b.entropy_bits + 1 && b.hops >= 1);
+    }
+    assert(raw_total == length && encoded_total + STREAM_HEADER_SIZE == interleaved_length);
+    // The last 1000 bytes would save less than their table costs
+    assert(!stats[2].stored && stats[3].stored);
+    // The first block only has 4 symbols, all with short codes
+    assert(stats[0].hops == 1 && stats[0].achieved_bits < 2.5);
+    FILE* export_file = tmpfile();
+    write_block_stats_csv(export_file, stats.data(), stats.size());
+    write_block_stats_json(export_file, stats.data(), stats.size());
+    rewind(export_file);
+    char line[1024];
+    assert(fgets(line, sizeof(line), export_file) && !strncmp(line, "block,stored,raw_bytes,encoded_bytes,", 37));
+    fclose(export_file);
+
+    // Frames with full table images (version 1 streams) still decode, and are bigger
+    unsigned char* frame = (unsigned char*) malloc(max_block_frame_size(BLOCK_SIZE_MAX));
+    size_t frame_length = encode_block(source, BLOCK_SIZE_MAX, frame, 0);
+    assert(frame_length > block_frame_size(encoded[0] + STREAM_HEADER_SIZE, stream_length[0],
+        STREAM_FLAG_PACKED_TABLES | STREAM_FLAG_STORED_BLOCKS));
+    assert(block_frame_size(frame, frame_length, 0) == frame_length);
+    memset(decoded, 0, length);
+    assert(decode_block(frame, frame_length, decoded, length, 0) == BLOCK_SIZE_MAX);
+    for (size_t i = 0; i < BLOCK_SIZE_MAX; i++)
+        assert(decoded[i] == source[i]);
+    // Their links are checked as well: past the 64 tables, or back to the same table
+    unsigned char* next_table = frame + BLOCK_HEADER_SIZE;
+    const unsigned char bad_links[][2] = { {0, 200}, {16, 1}, {32, 1} };
+    for (const auto& bad : bad_links) {
+        unsigned char old = next_table[bad[0]];
+        next_table[bad[0]] = bad[1];
+        assert(decode_block(frame, frame_length, decoded, length, 0) == 0);
+        next_table[bad[0]] = old;
+    }
+
+    // Random bytes are stored, text in the same stream is still coded
+    for (size_t i = 0; i < BLOCK_SIZE_MAX; i++) {
+        seed = seed * 1103515245 + 12345;
+        source[i] = seed >> 16;
+    }
+    FILE* mixed_stream = tmpfile();
+    options.interleaved = false;
+    size_t mixed_length = encode_blocks(source, 2 * BLOCK_SIZE_MAX, mixed_stream, &options);
+    unsigned char* mixed = (unsigned char*) malloc(mixed_length);
+    rewind(mixed_stream);
+    assert(fread(mixed, 1, mixed_length, mixed_stream) == mixed_length);
+    fclose(mixed_stream);
+    assert(stats.size() == 2 && stats[0].stored && !stats[1].stored);
+    assert(stats[0].encoded_bytes == BLOCK_SIZE_MAX && stats[0].n_table == 0 && stats[0].hops == 0);
+    assert(stats[0].length_histogram[8] == BLOCK_SIZE_MAX && stats[0].entropy_bits > 7.9);
+    const unsigned char* stored_frame = mixed + STREAM_HEADER_SIZE;
+    assert(block_frame_size(stored_frame, mixed_length - STREAM_HEADER_SIZE, STREAM_FLAG_PACKED_TABLES
+        | STREAM_FLAG_STORED_BLOCKS) == BLOCK_HEADER_SIZE + BLOCK_SIZE_MAX);
+    assert(block_raw_length(stored_frame) == BLOCK_SIZE_MAX);
+    memset(decoded, 0, length);
+    assert(decode_blocks(mixed, mixed_length, decoded, length, 4) == 2 * BLOCK_SIZE_MAX);
+    for (size_t i = 0; i < 2 * BLOCK_SIZE_MAX; i++)
+        assert(decoded[i] == source[i]);
+    free(mixed);
+    // Without stored blocks, the random block is coded, and comes out bigger
+    frame_length = encode_block(source, BLOCK_SIZE_MAX, frame, STREAM_FLAG_PACKED_TABLES);
+    assert(frame_length > BLOCK_HEADER_SIZE + BLOCK_SIZE_MAX && !(frame[3] & 0x80));
+    assert(decode_block(frame, frame_length, decoded, length, STREAM_FLAG_PACKED_TABLES) == BLOCK_SIZE_MAX);
+    // Coding saves about 60% of this block, which is not enough if it has to save 70%
+    frame_length = encode_block(source + BLOCK_SIZE_MAX, BLOCK_SIZE_MAX, frame, STREAM_FLAG_STORED_BLOCKS, NULL, 0.7);
+    assert(frame_length == BLOCK_HEADER_SIZE + BLOCK_SIZE_MAX);
+    free(frame);
+
+    free(source);
+    free(encoded[0]);
+    free(encoded[1]);
+    free(decoded);
+}
+
+void test_histogram() {
+    // Text-like data with long runs, at every length around the kernels' strides
+    unsigned char data[1100];
+    unsigned seed = 3;
+    for (int i = 0; i < 1100; i++) {
+        seed = seed * 1103515245 + 12345;
+        data[i] = (i / 100) % 2 ? ' ' : 'a' + (seed >> 16) % 26;
+    }
+    for (size_t length = 0; length <= 1100; length += (length < 70 ? 1 : 97)) {
+        unsigned ref[256] = {0};
+        for (size_t i = 0; i < length; i++) ref[data[i]]++;
+        unsigned freq[256];
+        count_frequency(data, length, freq);
+        for (int s = 0; s < 256; s++) assert(freq[s] == ref[s]);
+        count_frequency_scalar(data + 1, length ? length - 1 : 0, freq);
+        if (length) ref[data[0]]--;
+        for (int s = 0; s < 256; s++) assert(freq[s] == ref[s]);
+#ifdef HISTOGRAM_AVX2
+        if (cpu_has_avx2()) {
+            count_frequency_avx2(data + 1, length ? length - 1 : 0, freq);
+            for (int s = 0; s < 256; s++) assert(freq[s] == ref[s]);
+        }
+#endif
+    }
+}
+
+// Sink that appends to a memory buffer
+static void memory_sink(void* context, const unsigned char* data, size_t length) {
+    unsigned char** pos = (unsigned char**) context;
+    for (size_t i = 0; i < length; i++) *(*pos)++ = data[i];
+}
+
+void test_bit_writer() {
+    const unsigned char* data = (const unsigned char*) "the quick brown fox jumps over the lazy dog, again and again";
+    const size_t length = 60;
+    unsigned freq[256] = {0};
+    for (size_t i = 0; i < length; i++) freq[data[i]]++;
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+
+    // Reference: everything in one call
+    unsigned char ref[64] = {0};
+    size_t ref_length = encode_huffman(codes, data, length, ref, 64);
+
+    // Feed the symbols in uneven pieces through a tiny staging buffer
+    for (size_t piece = 1; piece <= 7; piece++) {
+        unsigned char out[64] = {0};
+        unsigned char* out_pos = out;
+        unsigned char staging[5];
+        bit_writer_t writer;
+        bit_writer_init(&writer, codes, staging, sizeof(staging), memory_sink, &out_pos);
+        for (size_t i = 0; i < length; i += piece)
+            bit_writer_write(&writer, data + i, length - i < piece ? length - i : piece);
+        assert(bit_writer_flush(&writer) == ref_length);
+        assert((size_t) (out_pos - out) == ref_length);
+        for (size_t i = 0; i < ref_length; i++)
+            assert(out[i] == ref[i]);
+    }
+
+    // Straight to a file
+    FILE* file = tmpfile();
+    unsigned char staging[16];
+    bit_writer_t writer;
+    bit_writer_init(&writer, codes, staging, sizeof(staging), file_bit_sink, file);
+    bit_writer_write(&writer, data, length);
+    assert(bit_writer_flush(&writer) == ref_length);
+    assert((size_t) ftell(file) == ref_length);
+    fclose(file);
+}
+
+void test_hw_model() {
+    // All 256 symbols equally likely: every code is 8 bits, two table hops per symbol
+    const size_t length = 1024;
+    unsigned char data[length];
+    for (size_t i = 0; i < length; i++) data[i] = i * 7;
+    unsigned freq[256];
+    count_frequency(data, length, freq);
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    huffman_code_t codes[256];
+    generate_code_table(root, codes);
+
+    pipeline_estimate_t estimate;
+    model_encoder(codes, data, length, &estimate);
+    assert(estimate.hops == 2 * length);
+    // The last byte goes out with the flush
+    assert(estimate.output_bytes == length);
+    assert(estimate.cycles == ENCODE_STARTUP_CYCLES + 4 * length + 1 + ENCODE_DRAIN_CYCLES);
+    assert(estimate.max_buffer_bits <= ENCODE_BUFFER_BITS);
+
+    // The first hop goes out once the first byte is in, then one hop per cycle
+    model_decoder(codes, data, length, &estimate);
+    assert(estimate.hops == 2 * length);
+    assert(estimate.stall_cycles == 0);
+    assert(estimate.cycles == DECODE_REFILL_LATENCY + 1 + 2 * length + DECODE_DRAIN_CYCLES);
+    assert(estimate.max_buffer_bits <= DECODE_BUFFER_BITS);
+
+    // Mixed code lengths: the encoder output matches the software encoder, and the
+    // decoder reads every byte of it without ever waiting for a refill
+    for (size_t i = 0; i < length; i++) data[i] = i % 3 ? 'e' : 'a' + (i * 11) % 26;
+    count_frequency(data, length, freq);
+    root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    generate_code_table(root, codes);
+    unsigned char encoded[length + 8];
+    size_t encoded_length = encode_huffman(codes, data, length, encoded, sizeof(encoded));
+    model_encoder(codes, data, length, &estimate);
+    assert(estimate.output_bytes == encoded_length);
+    assert(estimate.cycles >= ENCODE_STARTUP_CYCLES + 2 * estimate.hops + ENCODE_DRAIN_CYCLES);
+    model_decoder(codes, data, length, &estimate);
+    assert(estimate.stall_cycles == 0);
+    assert(estimate.sp_reads >= encoded_length);
+    assert(estimate.cycles == DECODE_REFILL_LATENCY + 1 + estimate.hops + DECODE_DRAIN_CYCLES);
+
+    // Nothing to do for an empty request
+    model_encoder(codes, data, 0, &estimate);
+    assert(estimate.cycles == 0);
+
+    // The sample HuffmanTester was measured on (see hw_model.h)
+    unsigned char sample[1000];
+    FILE* source = fopen("data/sample_data.txt", "r");
+    size_t sample_length = fread(sample, 1, sizeof(sample), source);
+    fclose(source);
+    assert(sample_length == sizeof(sample));
+    count_frequency(sample, sample_length, freq);
+    root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    generate_code_table(root, codes);
+    model_encoder(codes, sample, sample_length, &estimate);
+    assert(estimate.output_bytes == 523);
+    assert(estimate.cycles == 2482);
+    model_decoder(codes, sample, sample_length, &estimate);
+    assert(estimate.cycles == 1246);
+}
+
+void test_table_cache() {
+    // Two blocks of the same kind of text, and one of something else entirely
+    const size_t length = 4096;
+    static unsigned char blocks[3][length];
+    const char* words[] = {"GET", "/index.html", "200", "POST", "/api/v1/items", "404", "user=", "42"};
+    uint32_t state = 12345;
+    for (int b = 0; b < 2; b++) {
+        for (size_t i = 0; i < length;) {
+            state = state * 1103515245 + 12345;
+            const char* word = words[(state >> 16) % 8];
+            for (; *word && i < length; word++) blocks[b][i++] = *word;
+            if (i < length) blocks[b][i++] = (state >> 8) % 4 ? ' ' : '\n';
+        }
+    }
+    for (size_t i = 0; i < length; i++) blocks[2][i] = (i * 2654435761u) >> 24;
+
+    table_cache_t* cache = new table_cache_t;
+    table_cache_init(cache, 0.05);
+    unsigned freq[256];
+    bool reused;
+    count_frequency(blocks[0], length, freq);
+    const table_cache_entry_t* first = table_cache_get(cache, freq, &reused);
+    assert(!reused && first->id == 0);
+    // Close enough: the same table, which still decodes the second block
+    count_frequency(blocks[1], length, freq);
+    const table_cache_entry_t* second = table_cache_get(cache, freq, &reused);
+    assert(reused && second == first);
+    assert(code_cost_bits(second->codes, freq) <= 1.05 * entropy_bits(freq));
+    unsigned char encoded[length + 8];
+    unsigned char decoded[length];
+    encode_huffman(second->codes, blocks[1], length, encoded, sizeof(encoded));
+    struct table_root_t table;
+    map_table_image(&table, second->image);
+    decode_huffman(&table, encoded, sizeof(encoded), decoded, length);
+    for (size_t i = 0; i < length; i++) assert(decoded[i] == blocks[1][i]);
+    // Too far off: a new table
+    count_frequency(blocks[2], length, freq);
+    const table_cache_entry_t* third = table_cache_get(cache, freq, &reused);
+    assert(!reused && third->id == 1);
+    assert(cache->n_generated == 2 && cache->n_reused == 1);
+
+    // A negative penalty turns reuse off
+    table_cache_init(cache, -1);
+    count_frequency(blocks[0], length, freq);
+    table_cache_get(cache, freq, &reused);
+    table_cache_get(cache, freq, &reused);
+    assert(!reused && cache->n_generated == 2);
+
+    // With more distinct tables than entries, the least recently used one goes
+    table_cache_init(cache, 0);
+    for (int i = 0; i <= TABLE_CACHE_ENTRIES; i++) {
+        for (int s = 0; s < 256; s++) freq[s] = s == i ? 1000 : 1;
+        table_cache_get(cache, freq, &reused);
+        assert(!reused);
+    }
+    assert(cache->n_entries == TABLE_CACHE_ENTRIES);
+    for (int i = 0; i < TABLE_CACHE_ENTRIES; i++) assert(cache->entries[i].id != 0);
+    delete cache;
+}
+
+// Round trip a symbol stream over a big alphabet through the extended tables
+static void check_extended_alphabet(const unsigned short* symbols, size_t length, short nsymbols) {
+    unsigned freq[HUFFMAN_MAX_SYMBOLS] = {0};
+    for (size_t i = 0; i < length; i++) freq[symbols[i]]++;
+    huffman_arena_t arena;
+    length_limit_report_t report;
+    huffman_t* root = build_limited_huffman_tree(freq, nsymbols, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena, &report);
+    assert(report.n_table <= HUFFMAN_MAX_TABLES);
+    huffman_code_t codes[HUFFMAN_MAX_SYMBOLS];
+    generate_code_table(root, codes);
+    struct table_root_t table;
+    assert(generate_table_from_tree(&table, root) == (size_t) report.n_table);
+    assert(table.cutoff_lut && table.canonical_ext_lut && table.canonical_decode_ext_lut);
+    // The canonical tables still map symbols to canonical symbols and back
+    for (short s = 0; s < nsymbols; s++) {
+        unsigned canon = table.canonical_lut[s] | read_ext_bits(table.canonical_ext_lut, s) << 8;
+        assert(canon < (unsigned) nsymbols);
+        assert((table.canonical_decode_lut[canon] | read_ext_bits(table.canonical_decode_ext_lut, canon) << 8) == (unsigned) s);
+    }
+    unsigned char* image = new unsigned char[EXTENDED_TABLE_IMAGE_SIZE];
+    write_extended_table_image(&table, image);
+    free_table(&table);
+
+    size_t limit = 2 * length + 8;
+    unsigned char* encoded = new unsigned char[limit];
+    bit_writer_t writer;
+    bit_writer_init(&writer, codes, encoded, limit);
+    bit_writer_write_symbols(&writer, symbols, length);
+    size_t encoded_length = bit_writer_flush(&writer);
+    assert(!writer.overflow);
+    unsigned short* decoded = new unsigned short[length];
+    map_extended_table_image(&table, image);
+    assert(decode_huffman_symbols(&table, encoded, encoded_length, decoded, length) == encoded_length);
+    for (size_t i = 0; i < length; i++) assert(decoded[i] == symbols[i]);
+    delete [] decoded;
+    delete [] encoded;
+    delete [] image;
+}
+
+void test_table_update() {
+    // Text-like histogram: a few common letters, the rest rare
+    unsigned freq[256];
+    for (int s = 0; s < 256; s++) freq[s] = s >= 'a' && s <= 'z' ? 1000 + 97 * (s - 'a') : 1 + s % 3;
+    table_state_t* state = new table_state_t;
+    table_state_init(state, freq);
+    table_update_t update;
+    int delta[256] = {0};
+    assert(table_state_update(state, delta, &update) == 0 && update.n_lines == 0);
+
+    // A small drift only touches part of the image, and the result decodes like a fresh table
+    unsigned char before[TABLE_IMAGE_SIZE];
+    memcpy(before, state->image, TABLE_IMAGE_SIZE);
+    delta['e'] = 800;
+    delta['q'] = -300;
+    delta[0x80] = 5;
+    int n_lines = table_state_update(state, delta, &update);
+    assert(n_lines > 0 && n_lines < TABLE_IMAGE_LINES / 2 && update.n_lines == n_lines);
+    for (int i = 0; i < n_lines; i++) {
+        assert(i == 0 || update.lines[i] > update.lines[i - 1]);
+        memcpy(&before[8 * update.lines[i]], &state->image[8 * update.lines[i]], 8);
+    }
+    assert(!memcmp(before, state->image, TABLE_IMAGE_SIZE));
+    for (int s = 0; s < 256; s++) freq[s] += delta[s];
+    struct table_root_t fresh;
+    size_t n_table = generate_table(&fresh, freq, 256);
+    assert(n_table == state->n_table);
+    struct table_root_t mapped;
+    map_table_image(&mapped, state->image);
+    huffman_code_t codes[256];
+    generate_code_table_from_tables(&mapped, codes);
+    for (int s = 0; s < 256; s++) {
+        assert(codes[s].length == state->codes[s].length && codes[s].code == state->codes[s].code);
+        assert(mapped.canonical_lut[s] == fresh.canonical_lut[s]);
+    }
+    assert(!memcmp(mapped.next_table, fresh.next_table, 16 * n_table));
+    assert(!memcmp(mapped.upper_max_lut, fresh.upper_max_lut, 8 * n_table));
+    free_table(&fresh);
+    delete state;
+}
+
+void test_table_batch() {
+    unsigned freq[3 * 256];
+    for (int s = 0; s < 256; s++) {
+        freq[s] = 1;
+        freq[256 + s] = s < 40 ? 1u << (s / 2) : 1;
+        freq[512 + s] = 100 + s;
+    }
+    table_batch_t batch;
+    huffman_code_t codes[3 * 256];
+    batch.generate(freq, 3, codes);
+    assert(batch.size() == 3);
+    // Same images and codes as one generate_table() at a time
+    for (int i = 0; i < 3; i++) {
+        struct table_root_t table;
+        size_t n_table = generate_table(&table, &freq[i * 256], 256);
+        unsigned char image[TABLE_IMAGE_SIZE];
+        write_table_image(&table, image);
+        assert(batch.n_table(i) == n_table);
+        assert(!memcmp(batch.image(i), image, TABLE_IMAGE_SIZE));
+        huffman_code_t table_codes[256];
+        generate_code_table_from_tables(&table, table_codes);
+        for (int s = 0; s < 256; s++)
+            assert(codes[i * 256 + s].length == table_codes[s].length && codes[i * 256 + s].code == table_codes[s].code);
+        free_table(&table);
+    }
+    // A smaller batch reuses the buffer
+    const unsigned char* first = batch.image(0);
+    batch.generate(&freq[256], 2);
+    assert(batch.size() == 2 && batch.image(0) == first);
+    size_t n_table = batch.n_table(0);
+    // Moving hands the buffer over
+    table_batch_t moved(std::move(batch));
+    assert(moved.size() == 2 && moved.image(0) == first && moved.n_table(0) == n_table && batch.size() == 0);
+    batch = std::move(moved);
+    assert(batch.size() == 2 && batch.image(0) == first && moved.size() == 0);
+    struct table_root_t table;
+    batch.map(1, &table);
+    assert(table.next_table == batch.image(1));
+}
+
+void test_extended_alphabet() {
+    const size_t length = 20000;
+    unsigned short* symbols = new unsigned short[length];
+    uint64_t state = 88172645463325252ull;
+    auto next = [&]() {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    };
+    // DEFLATE literal/length alphabet: mostly text literals, some lengths, one end of block
+    for (size_t i = 0; i < length; i++) {
+        uint64_t r = next();
+        if (r % 8) symbols[i] = 'a' + (r >> 8) % 26;
+        else if (r % 64) symbols[i] = 257 + __builtin_ctzll(r >> 6 | 1ull << 28);
+        else symbols[i] = (r >> 16) % 256;
+    }
+    symbols[length - 1] = 256;
+    check_extended_alphabet(symbols, length, 286);
+
+    // Brotli insert-and-copy alphabet, all symbols about as likely: a plain code would need
+    // hundreds of tables, so the rare symbols have to be bundled
+    for (size_t i = 0; i < length; i++) symbols[i] = next() % 704;
+    check_extended_alphabet(symbols, length, 704);
+    delete [] symbols;
+
+    // Byte alphabets don't get the extension tables
+    unsigned freq[256];
+    for (int s = 0; s < 256; s++) freq[s] = s + 1;
+    struct table_root_t table;
+    generate_table(&table, freq, 256);
+    assert(!table.cutoff_lut && !table.canonical_ext_lut && !table.canonical_decode_ext_lut);
+    free_table(&table);
+}
+
 // Read data and count frequency
 void read_data(size_t read_max_length, size_t huffman_limit, const char* filename) {
     // Prepare buffer
@@ -149,12 +1051,10 @@ void read_data(size_t read_max_length, size_t huffman_limit, const char* filenam
 
     // Write table
     // We are using standard table size here (check generate_table())
+    unsigned char image[TABLE_IMAGE_SIZE];
+    write_table_image(&table, image);
     FILE* table_file = fopen("data/table.dat", "wb");
-    fwrite(table.next_table, 1, 16 * 64, table_file);
-    fwrite(table.upper_max_lut, 1, 8 * 64, table_file);
-    fwrite(table.lower_max_lut, 1, 8 * 64, table_file);
-    fwrite(table.canonical_lut, 1, 256, table_file);
-    fwrite(table.canonical_decode_lut, 1, 256, table_file);
+    fwrite(image, 1, TABLE_IMAGE_SIZE, table_file);
     fclose(table_file);
     
     // Print table for the article
@@ -176,6 +1076,7 @@ void read_data(size_t read_max_length, size_t huffman_limit, const char* filenam
     fclose(dst);
 
     // Clean up
+    free_table(&table);
     free(data);
     free(output);
 }
@@ -243,6 +1144,21 @@ int main() {
     test_huffman_ref(true, false);
     test_huffman_ref(false, true);
     test_huffman_ref(false, false);
+    test_huffman_decode();
+    test_fast_decode();
+    test_interleaved();
+    test_encode_tables();
+    test_static_table();
+    test_packed_table_image();
+    test_length_limit();
+    test_block_codec();
+    test_histogram();
+    test_bit_writer();
+    test_hw_model();
+    test_table_cache();
+    test_table_update();
+    test_table_batch();
+    test_extended_alphabet();
 
     read_data(1024, 4096, "data/sample_data.txt");
     return 0;
@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table_gen.h"
+#include "table_update.h"
+
+// Build the tables for freq into image and codes. Return the number of tables.
+static size_t build_image(const unsigned* freq, unsigned char* image, huffman_code_t* codes) {
+    huffman_arena_t arena;
+    huffman_t* root = build_limited_huffman_tree(freq, 256, HUFFMAN_MAX_CODE_LENGTH, HUFFMAN_MAX_TABLES, &arena);
+    generate_code_table(root, codes);
+    return generate_table_image(root, image);
+}
+
+// Start from a full table load
+void table_state_init(table_state_t* state, const unsigned* freq) {
+    memcpy(state->freq, freq, sizeof(state->freq));
+    state->n_table = build_image(freq, state->image, state->codes);
+}
+
+// Add delta to the histogram and bring the tables up to date. Unchanged symbols usually
+// keep their place in the tree, so most subtables come out the same and are left alone.
+// Tables past the ones in use are never read, so they don't need to be cleared.
+// Return the number of lines rewritten (also in update if given).
+int table_state_update(table_state_t* state, const int* delta, table_update_t* update) {
+    unsigned freq[256];
+    bool changed = false;
+    for (int s = 0; s < 256; s++) {
+        if (delta[s] < 0 && (unsigned) -delta[s] > state->freq[s]) {
+            fprintf(stderr, "table_state_update: symbol %d goes below 0\n", s);
+            exit(-1);
+        }
+        freq[s] = state->freq[s] + delta[s];
+        changed |= delta[s] != 0;
+    }
+    int n_lines = 0;
+    if (changed) {
+        unsigned char image[TABLE_IMAGE_SIZE];
+        size_t n_table = build_image(freq, image, state->codes);
+        for (int line = 0; line < TABLE_IMAGE_LINES; line++) {
+            // Lines of tables that are no longer in use keep whatever they held
+            bool unused = (line < TABLE_UPPER_LINE && (size_t) line / 2 >= n_table)
+                || (line >= TABLE_UPPER_LINE && line < TABLE_CANONICAL_LINE
+                    && (size_t) (line - TABLE_UPPER_LINE) % HUFFMAN_MAX_TABLES >= n_table);
+            if (unused || !memcmp(&state->image[8 * line], &image[8 * line], 8)) continue;
+            memcpy(&state->image[8 * line], &image[8 * line], 8);
+            if (update) update->lines[n_lines] = line;
+            n_lines++;
+        }
+        memcpy(state->freq, freq, sizeof(freq));
+        state->n_table = n_table;
+    }
+    if (update) update->n_lines = n_lines;
+    return n_lines;
+}
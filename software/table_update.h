@@ -0,0 +1,39 @@
+#ifndef TABLE_UPDATE_H_
+#define TABLE_UPDATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "table_gen.h"
+
+// Incremental table updates for slowly drifting streams. The state keeps the table image
+// the accelerator holds; an update applies a delta histogram, regenerates the tables and
+// only rewrites the 64-bit lines that differ, so the host can push just those to the
+// table SRAM between blocks.
+//
+// Lines are numbered in the data/table.dat layout (see write_table_image()), which is the
+// layout HuffmanTester loads: for table t, next_table is lines 2t and 2t + 1, upper_max_lut
+// is line TABLE_UPPER_LINE + t and lower_max_lut is line TABLE_LOWER_LINE + t. The
+// canonical tables (TABLE_CANONICAL_LINE and up) go to the order table memory.
+
+#define TABLE_IMAGE_LINES (TABLE_IMAGE_SIZE / 8)
+#define TABLE_UPPER_LINE (2 * HUFFMAN_MAX_TABLES)
+#define TABLE_LOWER_LINE (3 * HUFFMAN_MAX_TABLES)
+#define TABLE_CANONICAL_LINE (4 * HUFFMAN_MAX_TABLES)
+
+struct table_state_t {
+    unsigned freq[256];
+    unsigned char image[TABLE_IMAGE_SIZE];
+    huffman_code_t codes[256];
+    size_t n_table;
+};
+
+struct table_update_t {
+    unsigned short lines[TABLE_IMAGE_LINES]; // Changed lines, in increasing order
+    int n_lines;
+};
+
+void table_state_init(table_state_t* state, const unsigned* freq);
+int table_state_update(table_state_t* state, const int* delta, table_update_t* update);
+
+#endif
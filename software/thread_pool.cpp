@@ -0,0 +1,85 @@
+#include "thread_pool.h"
+
+// Index of the worker running on this thread, -1 outside the pool
+static thread_local int current_worker = -1;
+static thread_local const thread_pool_t* current_pool = nullptr;
+
+static int resolve_threads(int n_threads) {
+    if (n_threads > 0) return n_threads;
+    n_threads = std::thread::hardware_concurrency();
+    return n_threads > 0 ? n_threads : 1;
+}
+
+thread_pool_t::thread_pool_t(int n_threads) : queues(resolve_threads(n_threads)), n_queued(0), n_pending(0),
+    next_queue(0), stopping(false) {
+    for (int i = 0; i < (int) queues.size(); i++)
+        workers.emplace_back(&thread_pool_t::worker_loop, this, i);
+}
+
+thread_pool_t::~thread_pool_t() {
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+        stopping = true;
+    }
+    wake_cv.notify_all();
+    for (auto& worker : workers) worker.join();
+}
+
+void thread_pool_t::submit(std::function<void()> task) {
+    int id = current_pool == this ? current_worker : (int) (next_queue++ % queues.size());
+    n_pending++;
+    {
+        std::lock_guard<std::mutex> lock(queues[id].lock);
+        queues[id].tasks.push_back(std::move(task));
+    }
+    n_queued++;
+    // Take the sleep lock so a worker can't miss the wake up between checking n_queued and sleeping
+    {
+        std::lock_guard<std::mutex> lock(sleep_lock);
+    }
+    wake_cv.notify_one();
+}
+
+void thread_pool_t::wait() {
+    std::unique_lock<std::mutex> lock(done_lock);
+    done_cv.wait(lock, [this] { return n_pending == 0; });
+}
+
+// Own queue first (newest task, still warm in cache), then steal the oldest task of another worker
+bool thread_pool_t::pop_task(int id, std::function<void()>* task) {
+    int n_queues = queues.size();
+    for (int i = 0; i < n_queues; i++) {
+        task_queue_t& queue = queues[(id + i) % n_queues];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.tasks.empty()) continue;
+        if (i == 0) {
+            *task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        } else {
+            *task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        n_queued--;
+        return true;
+    }
+    return false;
+}
+
+void thread_pool_t::worker_loop(int id) {
+    current_worker = id;
+    current_pool = this;
+    while (true) {
+        std::function<void()> task;
+        if (pop_task(id, &task)) {
+            task();
+            if (--n_pending == 0) {
+                std::lock_guard<std::mutex> lock(done_lock);
+                done_cv.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(sleep_lock);
+        wake_cv.wait(lock, [this] { return stopping || n_queued != 0; });
+        if (stopping && n_queued == 0) return;
+    }
+}
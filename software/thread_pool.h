@@ -0,0 +1,50 @@
+#ifndef THREAD_POOL_H_
+#define THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool. Every worker has its own task queue: it takes work from
+// the back of its own queue, and when that is empty it steals from the front of the others.
+// Tasks submitted from outside the pool are spread round robin; tasks submitted from a
+// worker go to its own queue.
+class thread_pool_t {
+public:
+    // n_threads = 0 starts one worker per hardware thread
+    explicit thread_pool_t(int n_threads = 0);
+    ~thread_pool_t();
+    thread_pool_t(const thread_pool_t&) = delete;
+    thread_pool_t& operator=(const thread_pool_t&) = delete;
+
+    void submit(std::function<void()> task);
+    // Block until every submitted task has finished
+    void wait();
+    int size() const { return (int) workers.size(); }
+
+private:
+    struct task_queue_t {
+        std::mutex lock;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    bool pop_task(int id, std::function<void()>* task);
+    void worker_loop(int id);
+
+    std::vector<std::thread> workers;
+    std::vector<task_queue_t> queues;
+    std::atomic<size_t> n_queued; // Tasks waiting in a queue
+    std::atomic<size_t> n_pending; // Tasks not finished yet
+    std::atomic<unsigned> next_queue;
+    bool stopping;
+    std::mutex sleep_lock;
+    std::condition_variable wake_cv;
+    std::mutex done_lock;
+    std::condition_variable done_cv;
+};
+
+#endif